@@ -1,12 +1,27 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <atomic>
+#include <cmath>
 #include <csignal>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 
 // Short description of LC3
 // ------------------------
@@ -76,10 +91,24 @@
 // .STRINGZ - inserts a string of characters into the program binary at the
 // location it is written
 
+typedef uint8_t u8;
 typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int16_t i16;
 typedef int64_t i64;
 typedef size_t usize;
 
+// Rarely executed helpers (console dialogue, MMIO slow paths, faults)
+// wear this so the compiler keeps them out of the dispatch loop's
+// I-cache footprint; PGO reaches the same layout from profiles, this is
+// the sane default without them.
+#ifdef __GNUC__
+#define LC3_COLD __attribute__((noinline, cold))
+#else
+#define LC3_COLD
+#endif
+
 namespace lc3 {
 
 enum : u16 {
@@ -130,14 +159,183 @@ enum : u16 {
   kTrapIn = 0x23,     // get character from keyboard, echoed onto the terminal
   kTrapPutsp = 0x24,  // output a byte string
   kTrapHalt = 0x25,   // halt the program
+  kTrapSnap = 0x26,   // host extension: save a snapshot (see SaveSnapshot)
+  // Arithmetic/block extension traps, gated by --ext: one dispatch
+  // instead of the guest's software multiply or copy loop.
+  kTrapMul = 0x30,     // R0 = R0 * R1
+  kTrapDiv = 0x31,     // R0 = R0 / R1 (signed; 0 on divide-by-zero)
+  kTrapMod = 0x32,     // R0 = R0 % R1 (signed; 0 on divide-by-zero)
+  kTrapMemset = 0x33,  // fill R2 words at R0 with R1
+  kTrapMemcpy = 0x34,  // copy R2 words from R1 to R0
 };
 
 enum {
   kKeyboardStatus = 0xFE00,
   kKeyboardData = 0xFE02,
+  kBankSelect = 0xFE04,  // banked-memory extension; see VM::SwitchBank
+  // DMA block-transfer device (see VM::RunDma): the guest fills the
+  // descriptor registers and writes anything to kDmaCtl to start.
+  kDmaDir = 0xFE08,   // 0: input fd -> guest, 1: guest -> output fd
+  kDmaAddr = 0xFE0A,  // guest word address of the buffer
+  kDmaLen = 0xFE0C,   // transfer length in words
+  kDmaCtl = 0xFE0E,   // write: start; reads back as words actually moved
+  // Timer device (see VM::LatchTimer): reading a low half latches the
+  // matching high half, so a two-load read is tear-free. 32 bits of
+  // nanoseconds wrap every ~4.3 s, which is plenty for bracketing.
+  kTimerInstrLo = 0xFE10,  // retired micro-ops, low 16 bits
+  kTimerInstrHi = 0xFE12,
+  kTimerNsLo = 0xFE14,  // CLOCK_MONOTONIC nanoseconds, low 16 bits
+  kTimerNsHi = 0xFE16,
 };
 
+// KBSR[15] is the ready bit; KBSR[14] enables keyboard interrupts, which
+// vector through IVT entry 0x80 (see VM::ServiceInterrupt).
+constexpr u16 kKbIntEnable = 1 << 14;
+constexpr u16 kKbReady = 1 << 15;
+constexpr u16 kIvtBase = 0x0100;
+constexpr u16 kKeyboardVector = 0x80;
+
 constexpr int kMaxMemory = UINT16_MAX;
+// Full 2^16 words: kMaxMemory is the highest *address*, so the backing
+// needs one more word or a store to 0xFFFF lands past the end.
+constexpr usize kMemBytes = (kMaxMemory + 1) * sizeof(u16);
+
+// Banked-memory extension: writing a bank index to kBankSelect remaps
+// the 4K-word window at kBankWindow onto that bank of an 8 MB backing
+// file. The window must stay host-page-aligned inside memory_.
+constexpr u16 kBankWindow = 0xC000;
+constexpr u16 kBankWords = 0x1000;
+constexpr int kBankCnt = 1024;
+
+// Memory is dispatched per 256-word page so that only the two device
+// pages (0xFE00-0xFFFF) pay for MMIO handling; everything below is a raw
+// indexed read.
+constexpr u16 kDeviceBase = 0xFE00;
+constexpr int kPageShift = 8;
+constexpr int kPageCnt = 256;
+
+// First user-program address; everything below is the trap vector table,
+// the IVT and the supervisor region (see the memory map above). Checked
+// mode (--checked) faults guest accesses down there.
+constexpr u16 kUserBase = 0x3000;
+
+// Consecutive empty keyboard-status reads before the VM blocks on the
+// input queue instead of spinning.
+constexpr u32 kIdlePollThreshold = 1024;
+
+// Sidecar cache written next to an image by LoadImageMapped: the already
+// byte-swapped payload plus the source's size/mtime for validation, so a
+// warm start is a single copy with no conversion work.
+struct ImageCacheHeader {
+  u32 magic;
+  u16 origin;
+  u16 pad;
+  u32 words;
+  i64 src_size;
+  i64 src_mtime;
+};
+
+constexpr u32 kImageCacheMagic = 0x43334C43;  // "LC3C"
+
+// Precompiled container written by --compile: the byte-swapped memory
+// payload, the fully predecoded (and superinstruction-fused) micro-op
+// stream for that range, and an index of static branch/JSR targets.
+// Loading one is two flat copies -- no byte swapping, no decode, no
+// fusion scan -- and the block index pre-warms the JIT's hotness
+// counters so hot loops compile on first entry instead of the 32nd.
+// The micro-op numbering is an internal detail of this binary, so
+// uop_cnt pins a file to the layout that wrote it; a stale file is
+// rejected at load and needs a fresh --compile.
+struct Lc3xHeader {
+  u32 magic;
+  u32 uop_cnt;  // kUopCnt at write time; rejects stale micro-op layouts
+  u16 origin;
+  u16 pad;
+  u32 words;
+  u32 nblocks;
+};
+
+constexpr u32 kLc3xMagic = 0x58334C43;  // "LC3X"
+
+// Snapshot of a running VM: registers and the lazy condition value in the
+// header, then the full guest memory image at a page-aligned offset so
+// tooling (and a future restore path) can map it directly. Host-side
+// state -- output buffer, keyboard queue, decode/JIT caches -- is not
+// serialized; it rebuilds lazily after a restore.
+struct SnapshotHeader {
+  u32 magic;
+  u16 reg[kRegCnt];
+  u16 cc;
+};
+
+constexpr u32 kSnapshotMagic = 0x53334C43;  // "LC3S"
+constexpr usize kSnapshotMemOff = 4096;
+
+// Record/replay tracing
+// ---------------------
+//
+// A recorded run appends every non-deterministic input -- keyboard
+// status-read outcomes and blocking GETC/IN results -- to a large
+// preallocated arena (plain stores on the already-cold device path; no
+// per-event I/O) that a background thread drains to the trace file. A
+// replaying run feeds the events back in order instead of touching the
+// host keyboard, so a production run re-executes bit-identically under
+// an instrumented build.
+
+enum : u16 {
+  kEvStatusEmpty = 0,  // keyboard status read saw no pending key
+  kEvStatusKey = 1,    // keyboard status read delivered value as the key
+  kEvKey = 2,          // blocking GETC/IN returned value
+};
+
+struct TraceEvent {
+  u16 kind;
+  u16 value;
+};
+
+struct TraceHeader {
+  u32 magic;
+  u32 events;
+};
+
+constexpr u32 kTraceMagic = 0x52334C43;  // "LC3R"
+constexpr u32 kTraceArenaEvents = 1u << 24;  // 64 MB of arena
+constexpr int kTraceFlushUs = 50 * 1000;
+
+// Instruction tracing
+// -------------------
+//
+// --trace streams one fixed 8-byte record per retired instruction into a
+// pair of arenas: the interpreter appends plain stores to one while a
+// writer thread pushes the other to disk in large sequential writes,
+// then they swap. A record carries the PC, the raw instruction word, and
+// the destination register with its post-execution value. --trace-report
+// folds a trace file into per-PC hit counts (see ReportItrace). The JIT
+// is disabled while tracing so every retire passes the trace hook;
+// record volume, not interpretation, is the cost that matters here.
+
+struct ItraceRec {
+  u16 pc;
+  u16 instr;
+  u8 reg;   // destination register field of the decoded micro-op
+  u8 pad;
+  u16 val;  // reg_[reg] after the instruction executed
+};
+
+struct ItraceHeader {
+  u32 magic;
+  u32 pad;
+};
+
+constexpr u32 kItraceMagic = 0x54334C43;  // "LC3T"
+constexpr u32 kItraceArenaRecs = 1u << 20;  // 8 MB per arena, two arenas
+
+// Why a Step timeslice ended (see VM::Step and VmPool).
+enum VmRunState {
+  kVmReady,      // budget exhausted; more work pending
+  kVmWaitInput,  // guest is blocked or idle-polling on console input
+  kVmDone,       // guest halted (or died on a bad opcode)
+};
 
 u16 SignExtend(u16 x, int bits_cnt) {
   if ((x >> (bits_cnt - 1)) & 1) return (0xFFFF << bits_cnt) | x;
@@ -146,11 +344,44 @@ u16 SignExtend(u16 x, int bits_cnt) {
 
 u16 u16Swap(u16 x) { return (x >> 8) | (x << 8); }
 
+// Converts the big-endian image payload to host words, 16 bytes per
+// iteration where SSE2/NEON is available. Copy and swap are fused so the
+// image is touched once, which matters when thousands of short-lived VM
+// instances are launched per hour.
+void SwapCopy(u16 *dst, const u8 *src, usize words) {
+  usize i = 0;
+#ifdef __SSE2__
+  for (; i + 8 <= words; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 8 <= words; i += 8) {
+    vst1q_u8((u8 *)(dst + i), vrev16q_u8(vld1q_u8(src + i * 2)));
+  }
+#endif
+  for (; i < words; ++i) dst[i] = (u16)((src[i * 2] << 8) | src[i * 2 + 1]);
+}
+
 termios original_tio;
+bool term_raw = false;  // guards restore: only undo a setup we did
+
+void RestoreInputBuffering() {
+  if (!term_raw) return;
+  term_raw = false;
+  tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
 
-void RestoreInputBuffering() { tcsetattr(STDIN_FILENO, TCSANOW, &original_tio); }
+// The running VM, registered by Run so Ctrl-C can flush whatever guest
+// output is still sitting in its buffer (the g_profile_vm pattern).
+// FlushSigintVm is defined below the class; the handler predates it.
+class VM;
+VM *g_sigint_vm = NULL;
+void FlushSigintVm();
 
 void HandleInterrupt(int signal) {
+  FlushSigintVm();
   RestoreInputBuffering();
   printf("\n");
   exit(-2);
@@ -161,272 +392,3141 @@ void DisableInputBuffering() {
   struct termios new_tio = original_tio;
   new_tio.c_lflag &= ~ICANON & ~ECHO;
   tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+  term_raw = true;
 }
 
-u16 CheckKey() {
+// Owns the process terminal for an interactive session: raw mode on
+// construction, restored on destruction or SIGINT. Run and Step never
+// touch the terminal themselves, so embedders that route their own I/O
+// simply don't construct one and pay nothing.
+class TerminalGuard {
+ public:
+  TerminalGuard() {
+    signal(SIGINT, HandleInterrupt);
+    DisableInputBuffering();
+  }
+  ~TerminalGuard() { RestoreInputBuffering(); }
+};
+
+// select() on one fd; timeout_ms 0 is a pure poll.
+bool FdReadable(int fd, int timeout_ms) {
   fd_set readfds;
   FD_ZERO(&readfds);
-  FD_SET(STDIN_FILENO, &readfds);
+  FD_SET(fd, &readfds);
 
   timeval timeout = {
       .tv_sec = 0,
-      .tv_usec = 0,
+      .tv_usec = timeout_ms * 1000,
+  };
+  return select(fd + 1, &readfds, NULL, NULL, &timeout) != 0;
+}
+
+u16 CheckKey() { return FdReadable(STDIN_FILENO, 0); }
+
+// Keyboard input
+// --------------
+//
+// Guest code polls kKeyboardStatus in tight loops, and a select() syscall
+// per poll burns a host core doing nothing. Instead a detached reader
+// thread blocks in read(2) on stdin and deposits bytes into a lock-free
+// single-producer/single-consumer ring, so the status read is a pair of
+// atomic loads with no syscall. The condition variable is only used by
+// blocking consumers (GETC/IN); the poll path never touches it.
+
+struct KeyQueue {
+  u8 buf[256];
+  std::atomic<u32> head{0};  // written by the reader thread
+  std::atomic<u32> tail{0};  // written by the VM
+  std::atomic<bool> eof{false};
+  // VM's fused interrupt counter, if any. Atomic because the VM thread
+  // hooks it up (DeviceWrite) while the reader thread is already live
+  // in Push; acquire pairs with the release store there.
+  std::atomic<std::atomic<u32> *> pending{NULL};
+  pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+  bool Empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+  }
+
+  bool Full() const {
+    return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire) ==
+           sizeof(buf);
+  }
+
+  void Push(u8 c) {
+    u32 h = head.load(std::memory_order_relaxed);
+    buf[h % sizeof(buf)] = c;
+    head.store(h + 1, std::memory_order_release);
+    std::atomic<u32> *p = pending.load(std::memory_order_acquire);
+    if (p) p->fetch_add(1, std::memory_order_release);
+    Signal();
+  }
+
+  u8 Pop() {
+    u32 t = tail.load(std::memory_order_relaxed);
+    u8 c = buf[t % sizeof(buf)];
+    tail.store(t + 1, std::memory_order_release);
+    return c;
+  }
+
+  void Signal() {
+    pthread_mutex_lock(&mu);
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&mu);
+  }
+
+  void WaitReady() {
+    pthread_mutex_lock(&mu);
+    while (Empty() && !eof.load(std::memory_order_acquire)) pthread_cond_wait(&ready, &mu);
+    pthread_mutex_unlock(&mu);
+  }
+};
+
+// Asynchronous console output
+// ---------------------------
+//
+// With --async-out, FlushOutput hands the filled chunk to a writer
+// thread through this SPSC ring and the interpreter continues
+// immediately instead of stalling in write(2). Output traps already
+// copy guest words into out_buf_ (PUTS/PUTSP have to convert words to
+// bytes regardless), so by the time a chunk is queued it no longer
+// references memory_ and guest stores need no write barrier against
+// in-flight output. The producer only blocks when every chunk is in
+// flight, i.e. the guest is outrunning the sink by the whole ring.
+
+struct OutQueue {
+  enum { kChunks = 16 };
+
+  struct Chunk {
+    char buf[8192];
+    u32 len;
   };
-  return select(1, &readfds, NULL, NULL, &timeout) != 0;
+
+  Chunk chunks[kChunks];
+  std::atomic<u32> head{0};  // written by the VM
+  std::atomic<u32> tail{0};  // written by the writer thread
+  std::atomic<bool> stop{false};
+  pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t data = PTHREAD_COND_INITIALIZER;
+  pthread_cond_t space = PTHREAD_COND_INITIALIZER;
+
+  bool Empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+  }
+
+  bool Full() const {
+    return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire) == kChunks;
+  }
+
+  void Push(const char *buf, usize len) {
+    pthread_mutex_lock(&mu);
+    while (Full()) pthread_cond_wait(&space, &mu);
+    pthread_mutex_unlock(&mu);
+    u32 h = head.load(std::memory_order_relaxed);
+    Chunk &c = chunks[h % kChunks];
+    memcpy(c.buf, buf, len);
+    c.len = (u32)len;
+    head.store(h + 1, std::memory_order_release);
+    pthread_mutex_lock(&mu);
+    pthread_cond_signal(&data);
+    pthread_mutex_unlock(&mu);
+  }
+};
+
+void *KeyboardReader(void *arg) {
+  KeyQueue *q = (KeyQueue *)arg;
+  for (;;) {
+    u8 c;
+    if (read(STDIN_FILENO, &c, 1) <= 0) break;
+    while (q->Full()) usleep(1000);  // guest isn't draining; keystrokes are slow anyway
+    q->Push(c);
+  }
+  q->eof.store(true, std::memory_order_release);
+  q->Signal();
+  return NULL;
 }
 
 u16 R0(u16 instr) { return (instr >> 9) & 0x7; }
 u16 R1(u16 instr) { return (instr >> 6) & 0x7; }
 u16 R2(u16 instr) { return instr & 0x7; }
 
+// Predecode
+// ---------
+//
+// LC-3 code is static in the 0x3000-0xFDFF user region once LoadImage has
+// run, so there is no point re-extracting register fields and re-running
+// SignExtend on every trip through the interpreter loop. Each memory word
+// gets a cached Decoded entry in a 64K side array: an internal micro-op
+// (architectural opcodes split by addressing mode, so e.g. ADD-immediate
+// and ADD-register dispatch separately) plus pre-extracted fields.
+//
+// kUopMiss is 0 so that a zero-initialized cache decodes lazily: the miss
+// handler decodes the word in place and retries. Stores invalidate the
+// entry for the written address, which keeps self-modifying code correct.
+
+enum : u16 {
+  kUopMiss = 0,  // not decoded yet; must stay 0 (zero-init == miss)
+  kUopBr,
+  kUopAddR,
+  kUopAddI,
+  kUopAndR,
+  kUopAndI,
+  kUopJmp,
+  kUopJsrI,
+  kUopJsrR,
+  kUopLd,
+  kUopLdi,
+  kUopLdr,
+  kUopLea,
+  kUopNot,
+  kUopSt,
+  kUopSti,
+  kUopStr,
+  kUopTrap,
+  kUopRti,
+  // Fused pairs (superinstructions); these cover two memory words, so
+  // their handlers advance the PC past both.
+  kUopAddIBr,  // ADD Rx, Ry, #imm ; BR<mask> -- the classic loop back-edge
+  kUopNeg,     // NOT Rx, Ry ; ADD Rx, Rx, #1 -- two's-complement negate
+  kUopLdAdd,   // LD Ra ; ADD Rd, Rs, Ra -- load-and-accumulate
+  kUopBad,
+  kUopJit,  // start of a compiled basic block (LC3_JIT builds only)
+  kUopCnt,
+};
+
+// Indexed by Decoded::uop; used by the profile and benchmark reports.
+const char *const kUopNames[kUopCnt] = {
+    "miss", "br",  "add", "addi", "and",  "andi",    "jmp", "jsr",
+    "jsrr", "ld",  "ldi", "ldr",  "lea",  "not",     "st",  "sti",
+    "str",  "trap", "rti", "addi+br", "neg", "ld+add", "bad", "jit",
+};
+
+struct Decoded {
+  u16 uop;
+  u16 r0;    // DR/SR field; condition mask for kUopBr
+  u16 r1;
+  u16 r2;    // second source; branch condition mask for kUopAddIBr
+  u16 imm;   // pre-sign-extended immediate/offset; trap code for kUopTrap
+  u16 imm2;  // branch offset of the fused pair for kUopAddIBr
+};
+
+#ifdef LC3_JIT
+
+#ifndef __x86_64__
+#error "LC3_JIT emits x86-64 code only"
+#endif
+
+static_assert(sizeof(Decoded) == 12, "store invalidation scales decoded_ indices by 12");
+
+// JIT
+// ---
+//
+// Straight-line basic blocks (runs of ALU/load/store micro-ops ending at a
+// branch, jump, trap or anything else unsupported) are compiled into an
+// mmap'd executable buffer, keyed by start PC. Branch targets are counted
+// in the control-flow handlers; a target that crosses kJitThreshold gets
+// compiled and its decoded_ entry is repointed at kUopJit, so entering a
+// hot block costs the same single dispatch as any other micro-op.
+//
+// Compiled code follows the SysV ABI: the VM* arrives in rdi and reg_ and
+// memory_ are addressed at fixed offsets from it; eax/ecx/edx are
+// scratch. A block always returns with reg_[kRPC] set to the next
+// instruction the interpreter should execute. Loads that might hit the
+// device page (addr >= 0xFE00 is only known at run time) exit the block
+// early and let the interpreter replay the load through MemRead. Stores
+// stay in compiled code: they invalidate the target's decoded_ entry and
+// mark the target's page dirty; a store into an address covered by a
+// compiled block (jit_span_) exits so the interpreter finishes the block
+// from fresh decode entries.
+//
+// Self-modifying code is handled lazily through page_dirty_: every store
+// marks its 256-word page with one unconditional byte write, and block
+// entry checks the (at most two) pages the block covers -- a dirty hit
+// re-hashes the blocks on dirty pages and drops only those whose source
+// words changed (JitVetDirty). Stores carry no code-range compare; the
+// cost moves to one or two predictable loads per block entry.
+
+constexpr int kJitThreshold = 32;       // block entries before compiling
+constexpr int kJitMaxBlocks = 1024;
+constexpr int kJitMaxBlockLen = 64;     // LC-3 instructions per block
+constexpr usize kJitMaxInstrBytes = 160;  // worst-case emitted bytes
+constexpr usize kJitBufSize = 1 << 20;
+
+// Append-only x86-64 code writer with 1-byte relative jump patching.
+// Register indices follow instruction encoding: 0=eax, 1=ecx, 2=edx.
+struct CodeBuf {
+  u8 *base;
+  u8 *p;
+
+  void Byte(u8 b) { *p++ = b; }
+  void Imm16(u16 v) {
+    memcpy(p, &v, sizeof(v));
+    p += sizeof(v);
+  }
+  void Imm32(u32 v) {
+    memcpy(p, &v, sizeof(v));
+    p += sizeof(v);
+  }
+
+  // movzx r32, word [rdi + disp32]
+  void LoadWord(int r, u32 disp) {
+    Byte(0x0F);
+    Byte(0xB7);
+    Byte(0x80 | (r << 3) | 0x07);
+    Imm32(disp);
+  }
+  // mov word [rdi + disp32], r16
+  void StoreWord(int r, u32 disp) {
+    Byte(0x66);
+    Byte(0x89);
+    Byte(0x80 | (r << 3) | 0x07);
+    Imm32(disp);
+  }
+  // mov r64, qword [rdi + disp32] -- fetches a pointer member (memory_)
+  void LoadPtr(int r, u32 disp) {
+    Byte(0x48);
+    Byte(0x8B);
+    Byte(0x80 | (r << 3) | 0x07);
+    Imm32(disp);
+  }
+  // movzx r32, word [base64 + idx*2]
+  void LoadWordIdxAt(int r, int idx, int base) {
+    Byte(0x0F);
+    Byte(0xB7);
+    Byte(0x04 | (r << 3));
+    Byte(0x40 | (idx << 3) | base);
+  }
+  // mov word [base64 + idx*2], r16
+  void StoreWordIdxAt(int r, int idx, int base) {
+    Byte(0x66);
+    Byte(0x89);
+    Byte(0x04 | (r << 3));
+    Byte(0x40 | (idx << 3) | base);
+  }
+  // mov word [rdi + disp32], imm16
+  void StoreImm16(u32 disp, u16 v) {
+    Byte(0x66);
+    Byte(0xC7);
+    Byte(0x87);
+    Imm32(disp);
+    Imm16(v);
+  }
+  // mov dword [rdi + disp32], imm32
+  void StoreImm32(u32 disp, u32 v) {
+    Byte(0xC7);
+    Byte(0x87);
+    Imm32(disp);
+    Imm32(v);
+  }
+  // mov word [rdi + idx*4 + disp32], imm16
+  void StoreImm16Idx4(int idx, u32 disp, u16 v) {
+    Byte(0x66);
+    Byte(0xC7);
+    Byte(0x84);
+    Byte(0x87 | (idx << 3));
+    Imm32(disp);
+    Imm16(v);
+  }
+  // mov r32, imm32
+  void MovImm(int r, u32 v) {
+    Byte(0xB8 + r);
+    Imm32(v);
+  }
+  void Add(int dst, int src) {
+    Byte(0x01);
+    Byte(0xC0 | (src << 3) | dst);
+  }
+  void And(int dst, int src) {
+    Byte(0x21);
+    Byte(0xC0 | (src << 3) | dst);
+  }
+  void Not(int r) {
+    Byte(0xF7);
+    Byte(0xD0 | r);
+  }
+  void AddImm(int r, u32 v) {
+    if (r == 0) {
+      Byte(0x05);
+    } else {
+      Byte(0x81);
+      Byte(0xC0 | r);
+    }
+    Imm32(v);
+  }
+  // sub r32, imm8
+  void SubImm8(int r, u8 v) {
+    Byte(0x83);
+    Byte(0xE8 | r);
+    Byte(v);
+  }
+  void AndImm(int r, u32 v) {
+    if (r == 0) {
+      Byte(0x25);
+    } else {
+      Byte(0x81);
+      Byte(0xE0 | r);
+    }
+    Imm32(v);
+  }
+  void CmpImm(int r, u32 v) {
+    if (r == 0) {
+      Byte(0x3D);
+    } else {
+      Byte(0x81);
+      Byte(0xF8 | r);
+    }
+    Imm32(v);
+  }
+  // cmp byte [rdi + idx + disp32], 0
+  void CmpByteIdx(int idx, u32 disp) {
+    Byte(0x80);
+    Byte(0xBC);
+    Byte(0x07 | (idx << 3));
+    Imm32(disp);
+    Byte(0x00);
+  }
+  // mov byte [rdi + r_idx + disp32], v
+  void StoreByteIdx(int idx, u32 disp, u8 v) {
+    Byte(0xC6);
+    Byte(0x84);
+    Byte(0x07 | (idx << 3));
+    Imm32(disp);
+    Byte(v);
+  }
+  void MovReg(int dst, int src) {
+    Byte(0x89);
+    Byte(0xC0 | (src << 3) | dst);
+  }
+  void ShrImm(int r, u8 n) {
+    Byte(0xC1);
+    Byte(0xE8 | r);
+    Byte(n);
+  }
+  // movzx r32, r16 -- truncate back to 16 bits after arithmetic
+  void Trunc(int r) {
+    Byte(0x0F);
+    Byte(0xB7);
+    Byte(0xC0 | (r << 3) | r);
+  }
+  // lea dst32, [src + src*2] -- with the *4 store scale this addresses
+  // sizeof(Decoded) == 12 byte entries
+  void LeaTimes3(int dst, int src) {
+    Byte(0x8D);
+    Byte(0x04 | (dst << 3));
+    Byte(0x40 | (src << 3) | src);
+  }
+  void Ret() { Byte(0xC3); }
+
+  // Emits a jcc/jmp (0xEB) with an 8-bit displacement to be patched later;
+  // returns the position of the displacement byte.
+  usize Jcc8(u8 op) {
+    Byte(op);
+    Byte(0);
+    return (usize)(p - base) - 1;
+  }
+  void PatchTo(usize rel_at) { base[rel_at] = (u8)((usize)(p - base) - (rel_at + 1)); }
+};
+
+#endif  // LC3_JIT
+
 class VM {
  public:
+  VM() {
+    // Guest memory is a private anonymous mapping rather than an inline
+    // array so AttachMemory can swap in a copy-on-write view of a shared
+    // master; untouched pages also stay lazily zero this way.
+    memory_ = (u16 *)mmap(NULL, kMemBytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory_ == MAP_FAILED) {
+      printf("can't map guest memory\n");
+      exit(-1);
+    }
+    for (int i = 0; i < kPageCnt; ++i) page_read_[i] = ReadDirect;
+    for (int i = kDeviceBase >> kPageShift; i < kPageCnt; ++i) page_read_[i] = ReadDevice;
+  }
+
+  ~VM() {
+    munmap(memory_, kMemBytes);
+    if (bank_fd_ >= 0) close(bank_fd_);
+  }
+
   bool LoadImage(const char *image, int image_size) {
     if (!image || image_size == 0 || image_size > kMaxMemory) return false;
 
     u16 origin;
     memcpy(&origin, image, sizeof(origin));
     origin = u16Swap(origin);
-    usize n = image_size - sizeof(origin);
-    memcpy(memory_ + origin, image + sizeof(origin), n);
+    usize words = (image_size - sizeof(origin)) / sizeof(u16);
+    if (origin + words > kMaxMemory) return false;  // would convert past the backing
+    SwapCopy(memory_ + origin, (const u8 *)image + sizeof(origin), words);
+    PredecodeRange(origin, words);
+
+    return true;
+  }
+
+  bool LoadImageMapped(const char *path);
+
+  // Ahead-of-time half of the .lc3x path: load the .obj, predecode and
+  // fuse it the same way Run would, then serialize the result plus the
+  // static control-flow targets. LoadImageMapped recognizes the output
+  // by magic, so a compiled image runs with a plain `lc3 <file>.lc3x`.
+  bool CompileLc3x(const char *in_path, const char *out_path);
 
-    u16 *p = memory_ + origin;
-    while (n-- > 0) {
-      *p = u16Swap(*p);
-      ++p;
+  // Copy-on-write memory sharing across instances: ShareMemory publishes
+  // this VM's guest memory as a master (a memfd), AttachMemory replaces a
+  // fresh VM's memory with a private view of one. The MMU shares the
+  // read-only pages and copies a page on the first store into it, so N
+  // identical guests cost one master image plus their dirty pages.
+  int ShareMemory() {
+    int fd = memfd_create("lc3-mem", 0);
+    if (fd < 0) return -1;
+    if (write(fd, memory_, kMemBytes) != (i64)kMemBytes) {
+      close(fd);
+      return -1;
     }
+    return fd;
+  }
+
+  bool AttachMemory(int fd) {
+    void *m = mmap(NULL, kMemBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) return false;
+    munmap(memory_, kMemBytes);
+    memory_ = (u16 *)m;
+    cur_bank_ = -1;  // the old mapping took any bank window with it
+    // This VM now runs the master's image; decode state starts over.
+    memset(decoded_, 0, sizeof(decoded_));
+#ifdef LC3_JIT
+    JitFlush();
+#endif
+    return true;
+  }
+
+  // Warm starts: serialize/restore guest state (memory_, reg_, cc_) in
+  // the flat SnapshotHeader format. A restored VM resumes right after
+  // the kTrapSnap that saved it.
+  bool SaveSnapshot(int fd);
+  bool RestoreSnapshot(int fd);
+
+  // Where kTrapSnap writes its snapshot; the trap is a no-op without it.
+  void SetSnapshotPath(const char *path) { snapshot_path_ = path; }
+
+  // Starts recording non-deterministic inputs to `path`; see the
+  // record/replay comment above TraceEvent.
+  bool StartRecord(const char *path) {
+    rec_fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (rec_fd_ < 0) return false;
+    TraceHeader h = {kTraceMagic, 0};  // event count patched at finish
+    if (write(rec_fd_, &h, sizeof(h)) != (i64)sizeof(h)) {
+      close(rec_fd_);
+      rec_fd_ = -1;
+      return false;
+    }
+    rec_buf_ = (TraceEvent *)mmap(NULL, kTraceArenaEvents * sizeof(TraceEvent),
+                                  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rec_buf_ == MAP_FAILED) {
+      rec_buf_ = NULL;
+      close(rec_fd_);
+      rec_fd_ = -1;
+      return false;
+    }
+    pthread_create(&rec_thread_, NULL, TraceFlusher, this);
+    return true;
+  }
+
+  // Loads a recorded trace and switches all input to it.
+  bool LoadReplay(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    TraceHeader h;
+    bool ok = fstat(fd, &st) == 0 &&
+              read(fd, &h, sizeof(h)) == (i64)sizeof(h) && h.magic == kTraceMagic &&
+              // The count sizes an allocation below; a corrupt header must
+              // not turn into a multi-gigabyte new[] and an abort.
+              (usize)st.st_size == sizeof(h) + h.events * sizeof(TraceEvent);
+    if (ok) {
+      rep_buf_ = new TraceEvent[h.events ? h.events : 1];
+      i64 bytes = (i64)(h.events * sizeof(TraceEvent));
+      ok = read(fd, rep_buf_, bytes) == bytes;
+      rep_len_ = h.events;
+    }
+    close(fd);
+    replay_ = ok;
+    return ok;
+  }
 
+  // Starts streaming the per-instruction binary trace to `path`; see the
+  // instruction-tracing comment above ItraceRec.
+  bool StartItrace(const char *path) {
+    itrace_fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (itrace_fd_ < 0) return false;
+    ItraceHeader h = {kItraceMagic, 0};
+    if (write(itrace_fd_, &h, sizeof(h)) != (i64)sizeof(h)) {
+      close(itrace_fd_);
+      itrace_fd_ = -1;
+      return false;
+    }
+    for (int i = 0; i < 2; ++i) {
+      itrace_buf_[i] = (ItraceRec *)mmap(NULL, kItraceArenaRecs * sizeof(ItraceRec),
+                                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                         -1, 0);
+      if (itrace_buf_[i] == MAP_FAILED) {
+        itrace_buf_[i] = NULL;
+        close(itrace_fd_);
+        itrace_fd_ = -1;
+        return false;
+      }
+    }
+    pthread_mutex_init(&itrace_mu_, NULL);
+    pthread_cond_init(&itrace_data_, NULL);
+    pthread_cond_init(&itrace_space_, NULL);
+    pthread_create(&itrace_thread_, NULL, ItraceWriter, this);
+#ifdef LC3_JIT
+    jit_disabled_ = true;  // every retire has to pass the trace hook
+#endif
     return true;
   }
 
   void Run();
 
+  // Resumable execution: run at most `max_instructions` dispatches and
+  // return why the slice ended, with all loop state kept in the object.
+  // A stepped VM never touches the terminal, never blocks on input (a
+  // pending GETC/IN yields kVmWaitInput and re-executes once fed), and
+  // does its console I/O on the routed fds, so an external event loop
+  // can multiplex thousands of instances on a few threads -- VmPool and
+  // the fleet runner are in-tree callers, but the API stands alone.
+  VmRunState Step(u64 max_instructions);
+
+  // Console routing for pooled guests; defaults are the process stdio.
+  void SetInputFd(int fd) { in_fd_ = fd; }
+  void SetOutputFd(int fd) { out_fd_ = fd; }
+
+  // Blocks up to timeout_ms for this guest's input to become readable;
+  // the pool calls it before requeueing a kVmWaitInput guest.
+  void WaitForInput(int timeout_ms) { FdReadable(in_fd_, timeout_ms); }
+
+  // Flush console output after every trap instead of batching (interactive
+  // use; restores the pre-buffering behaviour).
+  void SetUnbuffered(bool on) { unbuffered_ = on; }
+
+  // Pipelines console output through a writer thread (see OutQueue);
+  // FlushOutput then costs a chunk copy instead of a blocking write(2).
+  void EnableAsyncOutput() {
+    if (outq_) return;
+    outq_ = new OutQueue();
+    pthread_create(&out_thread_, NULL, OutputWriter, this);
+  }
+
+  // Benchmark hooks (see RunBench below). Bench I/O mode discards console
+  // output, never touches the terminal or stdin, and reports the keyboard
+  // as permanently idle so workloads are pure CPU.
+  void SetBenchIo(bool on) { bench_io_ = on; }
+
+  // Opts in to the arithmetic/block extension traps (0x30-0x34).
+  // Off by default so images written for a stock LC-3 trap table keep
+  // their behaviour (unknown codes stay no-ops).
+  void EnableExtTraps() { ext_traps_ = true; }
+
+  // Batch mode (--batch): the guest gets no keyboard. Run picks a
+  // RunLoop instantiation with the terminal and reader-thread paths
+  // compiled out, GETC reads the input fd directly, and status polls go
+  // through ReadDeviceBatch with no syscalls. For fleets piping images
+  // through closed or redirected stdin this is the whole I/O policy.
+  void SetBatch() {
+    batch_ = true;
+    for (int i = kDeviceBase >> kPageShift; i < kPageCnt; ++i)
+      page_read_[i] = ReadDeviceBatch;
+  }
+
+  // Debugging mode (--checked): fault guest loads and stores into the
+  // trap/IVT/supervisor regions below kUserBase. Loads ride the page
+  // dispatch and stores fold into the existing device-page compare via
+  // store_guard_, so the unchecked fast paths keep their single branch.
+  // The JIT sits out because compiled stores bypass the guard.
+  void SetChecked() {
+    store_guard_ = kUserBase;
+    for (int i = 0; i < (kUserBase >> kPageShift); ++i) page_read_[i] = ReadCheckedLow;
+#ifdef LC3_JIT
+    jit_disabled_ = true;
+#endif
+  }
+
+  // Execution profile: per-uop dispatch counters, a full 64K-bucket PC-hit
+  // histogram, and trap/MMIO counts. Heap-allocated on demand (~512 KB);
+  // the unprofiled RunLoop<false> instantiation carries none of it.
+  struct Profile {
+    u64 uop_counts[kUopCnt];
+    u64 pc_hits[kMaxMemory + 1];
+    u64 trap_counts[256];
+    u64 mmio_reads;
+    u64 mmio_writes;
+  };
+
+  // Switches Run onto the counting RunLoop<true> instantiation. Forces
+  // the JIT off so every retired instruction is observed by the dispatch
+  // loop; with dump_at_exit the report is printed on halt (and on
+  // SIGUSR1, see HandleProfileDump).
+  void EnableProfile(bool dump_at_exit) {
+    if (!prof_) prof_ = new Profile();
+    profile_dump_ = dump_at_exit;
+#ifdef LC3_JIT
+    jit_disabled_ = true;
+#endif
+  }
+
+  const Profile *GetProfile() const { return prof_; }
+
+  void DumpProfile() const;
+
+  // SIGINT path: up to 8KB of produced output may still be buffered, and
+  // the signal can land while this very thread holds the writer queue's
+  // lock, so write the tail directly instead of routing through
+  // FlushOutput. Chunks already queued are the writer thread's problem.
+  void FlushOnSignal() {
+    usize n = out_len_;
+    out_len_ = 0;
+    if (n && !bench_io_ && write(out_fd_, out_buf_, n) < 0) { /* console gone */ }
+  }
+
+  // Loads an already host-order word array (the embedded bench images).
+  void LoadWords(u16 origin, const u16 *words, usize n) {
+    memcpy(memory_ + origin, words, n * sizeof(u16));
+    PredecodeRange(origin, n);
+  }
+
  private:
-  void UpdateFlag(u16 r) {
-    if (reg_[r] == 0) {
-      reg_[kRCond] = kFlZro;
-    } else if (reg_[r] >> 15) {
-      reg_[kRCond] = kFlNeg;
-    } else {
-      reg_[kRCond] = kFlPos;
+  // Console output is batched in out_buf_ and flushed when the buffer
+  // fills, before any input trap (so prompts are visible), when the guest
+  // polls the keyboard, when it parks idle, on leaving an ISR (an
+  // interrupt-driven guest may never poll or trap again), and at halt.
+  // Per-character putc+fflush turns output-bound images into a syscall
+  // storm otherwise.
+  void PutByte(char c) {
+    out_buf_[out_len_++] = c;
+    if (out_len_ == sizeof(out_buf_)) FlushOutput();
+  }
+
+  void PutString(const char *s) {
+    while (*s) PutByte(*s++);
+  }
+
+  void FlushOutput() {
+    if (out_len_ == 0) return;
+    if (bench_io_) {  // measuring the guest, not the host console
+      out_len_ = 0;
+      return;
+    }
+    if (outq_) {
+      outq_->Push(out_buf_, out_len_);  // writer thread does the write
+      out_len_ = 0;
+      return;
     }
+    if (write(out_fd_, out_buf_, out_len_) < 0) { /* console gone; drop */ }
+    out_len_ = 0;
   }
 
-  u16 MemRead(size_t addr) {
-    if (addr == kKeyboardStatus) {
-      if (CheckKey()) {
-        memory_[kKeyboardStatus] = 1 << 15;
-        memory_[kKeyboardData] = getchar();
-      } else {
-        memory_[kKeyboardStatus] = 0;
+  // Writer-thread body: drains chunks to the routed output fd.
+  static void *OutputWriter(void *arg) {
+    VM *vm = (VM *)arg;
+    OutQueue *q = vm->outq_;
+    for (;;) {
+      pthread_mutex_lock(&q->mu);
+      while (q->Empty() && !q->stop.load(std::memory_order_acquire)) {
+        pthread_cond_wait(&q->data, &q->mu);
       }
+      pthread_mutex_unlock(&q->mu);
+      if (q->Empty()) return NULL;  // stopped and fully drained
+      u32 t = q->tail.load(std::memory_order_relaxed);
+      OutQueue::Chunk &c = q->chunks[t % OutQueue::kChunks];
+      if (write(vm->out_fd_, c.buf, c.len) < 0) { /* sink gone; keep draining */ }
+      q->tail.store(t + 1, std::memory_order_release);
+      pthread_mutex_lock(&q->mu);
+      pthread_cond_signal(&q->space);
+      pthread_mutex_unlock(&q->mu);
     }
-    return memory_[addr];
   }
 
-  u16 memory_[kMaxMemory] = {0};
-  u16 reg_[kRegCnt] = {0};
-};
+  // Stops the writer after everything queued has reached the fd.
+  void FinishAsyncOutput() {
+    pthread_mutex_lock(&outq_->mu);
+    outq_->stop.store(true, std::memory_order_release);
+    pthread_cond_signal(&outq_->data);
+    pthread_mutex_unlock(&outq_->mu);
+    pthread_join(out_thread_, NULL);
+  }
+  // Lazy condition flags: most results are overwritten before any branch
+  // looks at them, so flag-setting instructions just record the raw result
+  // (SetCc) and the N/Z/P mask is derived on demand by the consumer.
+  // reg_[kRCond] holds the materialized mask whenever CondMask has run.
+  void SetCc(u16 v) { cc_ = v; }
 
-void VM::Run() {
-  signal(SIGINT, HandleInterrupt);
-  DisableInputBuffering();
+  u16 CondMask() {
+    u16 fl;
+    if (cc_ == 0) {
+      fl = kFlZro;
+    } else if (cc_ >> 15) {
+      fl = kFlNeg;
+    } else {
+      fl = kFlPos;
+    }
+    reg_[kRCond] = fl;
+    return fl;
+  }
 
-  // Initial state
-  reg_[kRCond] = kFlZro;
-  reg_[kRPC] = 0x3000;
+  typedef u16 (*PageReadFn)(VM *vm, u16 addr);
 
-  bool running = true;
-  while (running) {
-    u16 addr = reg_[kRPC]++;
-    u16 instr = MemRead(addr);
-    u16 op = instr >> 12;
-
-    switch (op) {
-      case kOpAdd: {
-        u16 r0 = R0(instr);
-        u16 r1 = R1(instr);
-        if ((instr >> 5) & 0x1) {
-          reg_[r0] = reg_[r1] + SignExtend(instr & 0x1F, 5);
-        } else {
-          reg_[r0] = reg_[r1] + reg_[R2(instr)];
-        }
-        UpdateFlag(r0);
-        break;
+  static u16 ReadDirect(VM *vm, u16 addr) { return vm->memory_[addr]; }
+
+  // Installed over the sub-kUserBase pages by SetChecked; rides the same
+  // page dispatch as the device handlers, so unchecked runs never see it.
+  static u16 ReadCheckedLow(VM *vm, u16 addr) {
+    if (!vm->in_isr_) vm->CheckedFault("load", addr);
+    return vm->memory_[addr];
+  }
+
+  // Guest-visible timer: instruction counts come straight from the
+  // dispatch loop's counter and nanoseconds from clock_gettime, which
+  // the vDSO serves without entering the kernel -- a timer read is an
+  // ordinary device-page load.
+  static void LatchTimer(VM *vm, u16 addr) {
+    if (addr == kTimerInstrLo) {
+      u32 v = (u32)vm->instr_count_;
+      vm->memory_[kTimerInstrLo] = (u16)v;
+      vm->memory_[kTimerInstrHi] = (u16)(v >> 16);
+    } else if (addr == kTimerNsLo) {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      u32 v = (u32)((u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec);
+      vm->memory_[kTimerNsLo] = (u16)v;
+      vm->memory_[kTimerNsHi] = (u16)(v >> 16);
+    }
+  }
+
+  // Batch guests (--batch) never see keyboard input: the status register
+  // reads as permanently idle, with no readiness syscalls and no reader
+  // thread behind it.
+  static u16 ReadDeviceBatch(VM *vm, u16 addr) {
+    if (vm->prof_) ++vm->prof_->mmio_reads;
+    if (addr == kKeyboardStatus) vm->memory_[kKeyboardStatus] = 0;
+    LatchTimer(vm, addr);
+    return vm->memory_[addr];
+  }
+
+  static u16 ReadDevice(VM *vm, u16 addr) {
+    if (vm->prof_) ++vm->prof_->mmio_reads;
+    if (addr == kKeyboardStatus) {
+      if (vm->bench_io_) {  // keyboard is permanently idle under --bench
+        vm->memory_[kKeyboardStatus] = 0;
+        return vm->memory_[addr];
       }
-      case kOpAnd: {
-        u16 r0 = R0(instr);
-        u16 r1 = R1(instr);
-        if ((instr >> 5) & 0x1) {
-          reg_[r0] = reg_[r1] & SignExtend(instr & 0x1F, 5);
+      if (vm->replay_) {  // feed the recorded outcome back
+        TraceEvent e = vm->NextReplay();
+        if (e.kind == kEvStatusKey) {
+          vm->memory_[kKeyboardStatus] = 1 << 15;
+          vm->memory_[kKeyboardData] = e.value;
         } else {
-          reg_[r0] = reg_[r1] & reg_[R2(instr)];
+          vm->memory_[kKeyboardStatus] = 0;
         }
-        UpdateFlag(r0);
-        break;
+        return vm->memory_[addr];
       }
-      case kOpBr: {
-        if (reg_[kRCond] & ((instr >> 9) & 0x7)) {
-          reg_[kRPC] += SignExtend(instr & 0x1FF, 9);
+      if (vm->sliced_) {
+        // Pooled guests read their own fd directly; an empty poll yields
+        // the rest of the timeslice instead of spinning in the scheduler.
+        if (FdReadable(vm->in_fd_, 0)) {
+          u8 c;
+          if (read(vm->in_fd_, &c, 1) == 1) {
+            vm->memory_[kKeyboardStatus] = 1 << 15;
+            vm->memory_[kKeyboardData] = c;
+            return vm->memory_[addr];
+          }
         }
-        break;
+        vm->memory_[kKeyboardStatus] = 0;
+        vm->slice_state_ = kVmWaitInput;
+        vm->slice_budget_ = 0;
+        return vm->memory_[addr];
       }
-      case kOpJmp: /* RET */ {
-        reg_[kRPC] = reg_[R1(instr)];
-        break;
-      }
-      case kOpJsr: {
-        reg_[kR7] = reg_[kRPC];
-        if ((instr >> 11) & 0x1) {
-          // JSR
-          reg_[kRPC] += SignExtend(instr & 0x7FF, 11);
+      if (vm->out_len_) vm->FlushOutput();  // guest may be prompting before a poll loop
+      if (vm->StartKeyboard()) {
+        if (!vm->keys_->Empty()) {
+          vm->kb_idle_polls_ = 0;
+          vm->memory_[kKeyboardStatus] = 1 << 15;
+          vm->memory_[kKeyboardData] = vm->keys_->Pop();
         } else {
-          // JSRR
-          reg_[kRPC] = reg_[R1(instr)];
+          vm->memory_[kKeyboardStatus] = 0;
+          // A guest that keeps reading an empty status register with no
+          // intervening stores is an idle polling loop; park it on the
+          // queue instead of burning a host core, waking the moment the
+          // reader thread delivers a byte.
+          if (++vm->kb_idle_polls_ >= kIdlePollThreshold) {
+            vm->kb_idle_polls_ = 0;
+            if (!vm->keys_->eof.load(std::memory_order_acquire)) {
+              if (vm->out_len_) vm->FlushOutput();  // don't park on buffered output
+              vm->keys_->WaitReady();
+            }
+          }
         }
-        break;
-      }
-      case kOpLd: {
-        u16 r0 = R0(instr);
-        u16 addr = reg_[kRPC] + SignExtend(instr & 0x1FF, 9);
-        reg_[r0] = MemRead(addr);
-        UpdateFlag(r0);
-        break;
-      }
-      case kOpLdi: {
-        u16 r0 = R0(instr);
-        u16 addr = reg_[kRPC] + SignExtend(instr & 0x1FF, 9);
-        reg_[r0] = MemRead(MemRead(addr));
-        UpdateFlag(r0);
-        break;
+      } else if (CheckKey()) {  // no reader thread: select() fallback
+        vm->memory_[kKeyboardStatus] = 1 << 15;
+        vm->memory_[kKeyboardData] = getchar();
+      } else {
+        vm->memory_[kKeyboardStatus] = 0;
       }
-      case kOpLdr: {
-        u16 r0 = R0(instr);
-        u16 addr = reg_[R1(instr)] + SignExtend(instr & 0x3F, 6);
-        reg_[r0] = MemRead(addr);
-        UpdateFlag(r0);
-        break;
+      if (vm->rec_buf_) {  // log how this poll resolved
+        if (vm->memory_[kKeyboardStatus] >> 15) {
+          vm->Record(kEvStatusKey, vm->memory_[kKeyboardData]);
+        } else {
+          vm->Record(kEvStatusEmpty, 0);
+        }
       }
-      case kOpLea: {
-        u16 r0 = R0(instr);
-        reg_[r0] = reg_[kRPC] + SignExtend(instr & 0x1FF, 9);
-        UpdateFlag(r0);
-        break;
+    }
+    LatchTimer(vm, addr);
+    return vm->memory_[addr];
+  }
+
+  // Starts the reader thread on first keyboard access; returns false if
+  // it could not be started.
+  bool StartKeyboard() {
+    if (keys_) return true;
+    if (kb_failed_) return false;
+    KeyQueue *q = new KeyQueue();
+    pthread_t t;
+    if (pthread_create(&t, NULL, KeyboardReader, q) != 0) {
+      delete q;
+      kb_failed_ = true;
+      return false;
+    }
+    pthread_detach(t);  // stays blocked in read(2); q is intentionally leaked
+    keys_ = q;
+    return true;
+  }
+
+  // Record-path append: two stores and a release bump. The only branch
+  // is the full-arena backstop, on the already-cold device path.
+  void Record(u16 kind, u16 value) {
+    u32 n = rec_len_.load(std::memory_order_relaxed);
+    if (n == kTraceArenaEvents) return;  // arena full; stop recording
+    rec_buf_[n].kind = kind;
+    rec_buf_[n].value = value;
+    rec_len_.store(n + 1, std::memory_order_release);
+  }
+
+  // Next replay event; an exhausted trace reads as silence/EOF.
+  TraceEvent NextReplay() {
+    if (rep_pos_ < rep_len_) return rep_buf_[rep_pos_++];
+    TraceEvent e = {kEvStatusEmpty, (u16)EOF};
+    return e;
+  }
+
+  // Drains the arena to the trace file off-thread so the recording run
+  // never does per-event I/O.
+  static void *TraceFlusher(void *arg) {
+    VM *vm = (VM *)arg;
+    u32 flushed = 0;
+    for (;;) {
+      bool stop = vm->rec_stop_.load(std::memory_order_acquire);
+      u32 n = vm->rec_len_.load(std::memory_order_acquire);
+      if (n > flushed) {
+        i64 bytes = (i64)((n - flushed) * sizeof(TraceEvent));
+        if (write(vm->rec_fd_, vm->rec_buf_ + flushed, bytes) != bytes) break;
+        flushed = n;
       }
-      case kOpNot: {
-        u16 r0 = R0(instr);
-        reg_[r0] = ~reg_[R1(instr)];
-        UpdateFlag(r0);
-        break;
+      if (stop) break;
+      usleep(kTraceFlushUs);
+    }
+    return NULL;
+  }
+
+  // Joins the flusher and patches the final event count into the header.
+  void FinishRecord() {
+    rec_stop_.store(true, std::memory_order_release);
+    pthread_join(rec_thread_, NULL);
+    TraceHeader h = {kTraceMagic, rec_len_.load(std::memory_order_acquire)};
+    pwrite(rec_fd_, &h, sizeof(h), 0);
+    close(rec_fd_);
+    rec_fd_ = -1;
+  }
+
+  // Instruction-trace append: two stores and a length bump on the hot
+  // path; a full arena swaps with the one the writer thread is draining.
+  void ItraceAppend(u16 pc, u16 instr, const Decoded *d) {
+    ItraceRec *r = &itrace_buf_[itrace_cur_][itrace_len_++];
+    r->pc = pc;
+    r->instr = instr;
+    r->reg = (u8)(d->r0 & 7);
+    r->pad = 0;
+    r->val = reg_[d->r0 & 7];
+    if (itrace_len_ == kItraceArenaRecs) ItraceFlip();
+  }
+
+  void ItraceFlip() {
+    pthread_mutex_lock(&itrace_mu_);
+    while (itrace_pending_ >= 0) pthread_cond_wait(&itrace_space_, &itrace_mu_);
+    itrace_pending_ = itrace_cur_;
+    itrace_pending_len_ = itrace_len_;
+    pthread_cond_signal(&itrace_data_);
+    pthread_mutex_unlock(&itrace_mu_);
+    itrace_cur_ ^= 1;
+    itrace_len_ = 0;
+  }
+
+  static void *ItraceWriter(void *arg) {
+    VM *vm = (VM *)arg;
+    pthread_mutex_lock(&vm->itrace_mu_);
+    for (;;) {
+      while (vm->itrace_pending_ < 0 && !vm->itrace_stop_.load(std::memory_order_acquire)) {
+        pthread_cond_wait(&vm->itrace_data_, &vm->itrace_mu_);
       }
-      case kOpRti:
-      case kOpRes:
-        printf("bad opcode");
-        running = false;
-        break;
-      case kOpSt: {
-        u16 addr = reg_[kRPC] + SignExtend(instr & 0x1FF, 9);
-        memory_[addr] = reg_[R0(instr)];
-        break;
+      if (vm->itrace_pending_ < 0) break;  // stopped and fully drained
+      int idx = vm->itrace_pending_;
+      usize bytes = (usize)vm->itrace_pending_len_ * sizeof(ItraceRec);
+      pthread_mutex_unlock(&vm->itrace_mu_);
+      if (write(vm->itrace_fd_, vm->itrace_buf_[idx], bytes) < 0) { /* sink gone */ }
+      pthread_mutex_lock(&vm->itrace_mu_);
+      vm->itrace_pending_ = -1;
+      pthread_cond_signal(&vm->itrace_space_);
+    }
+    pthread_mutex_unlock(&vm->itrace_mu_);
+    return NULL;
+  }
+
+  void FinishItrace() {
+    if (itrace_len_) ItraceFlip();
+    pthread_mutex_lock(&itrace_mu_);
+    itrace_stop_.store(true, std::memory_order_release);
+    pthread_cond_signal(&itrace_data_);
+    pthread_mutex_unlock(&itrace_mu_);
+    pthread_join(itrace_thread_, NULL);
+    close(itrace_fd_);
+    itrace_fd_ = -1;
+    for (int i = 0; i < 2; ++i) munmap(itrace_buf_[i], kItraceArenaRecs * sizeof(ItraceRec));
+    itrace_buf_[0] = itrace_buf_[1] = NULL;
+  }
+
+  // One byte straight off the routed input fd (sliced guests only; the
+  // caller has already checked readability). EOF maps like getchar.
+  u16 ReadByteFd() {
+    u8 c;
+    return read(in_fd_, &c, 1) == 1 ? c : (u16)EOF;
+  }
+
+  // Blocking read of one input byte. Once the reader thread owns stdin
+  // all input has to come through the queue.
+  u16 ReadKey() {
+    if (!keys_) return getchar();
+    while (keys_->Empty()) {
+      if (keys_->eof.load(std::memory_order_acquire)) return (u16)EOF;
+      keys_->WaitReady();
+    }
+    return keys_->Pop();
+  }
+
+  // The x23 IN dialogue, out-of-lined: prompt text, a blocking read and
+  // an echo have no business sharing I-cache with the dispatch loop.
+  LC3_COLD void TrapInPrompt(bool fd_read) {
+    PutString("Enter a character: ");
+    FlushOutput();
+    char c;
+    if (replay_) {
+      c = (char)NextReplay().value;
+    } else {
+      c = (char)(fd_read ? ReadByteFd() : ReadKey());
+      if (rec_buf_) Record(kEvKey, (u16)(u8)c);
+    }
+    PutByte(c);
+    FlushOutput();
+    reg_[kR0] = c;
+    SetCc(reg_[kR0]);
+  }
+
+  LC3_COLD void TrapSnap() {
+    if (!snapshot_path_) return;  // not armed on this run
+    FlushOutput();  // the output buffer is host state, not saved
+    int fd = open(snapshot_path_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && SaveSnapshot(fd);
+    if (fd >= 0) close(fd);
+    if (!ok) printf("can't write snapshot: %s\n", snapshot_path_);
+  }
+
+  // Instruction fetch never comes through here: it runs off decoded_ and
+  // Decode reads memory_ directly, since the PC can't legally point into
+  // the device page.
+  u16 MemRead(u16 addr) { return page_read_[addr >> kPageShift](this, addr); }
+
+  void MemWrite(u16 addr, u16 val) {
+    memory_[addr] = val;
+    decoded_[addr].uop = kUopMiss;  // invalidate in case this was code
+    decoded_[(u16)(addr - 1)].uop = kUopMiss;  // and any fused pair headed there
+    kb_idle_polls_ = 0;             // stores mean the poll loop is doing work
+    page_dirty_[addr >> kPageShift] = 1;  // lazy SMC tracking; see kUopJit entry
+    // One wrap-around compare covers both cold ends: store_guard_ is 0
+    // normally, making this exactly `addr >= kDeviceBase`; checked mode
+    // raises it to kUserBase so supervisor stores wrap past the limit
+    // too. Either way the fast path pays the same single branch.
+    if ((u16)(addr - store_guard_) >= (u16)(kDeviceBase - store_guard_)) StoreSlow(addr, val);
+  }
+
+  // Off the store fast path: the device page proper, or a checked-mode
+  // fault. ISR entry and the handler itself legitimately touch the
+  // supervisor stack, so in_isr_ accesses pass.
+  LC3_COLD void StoreSlow(u16 addr, u16 val) {
+    if (addr >= kDeviceBase) {
+      DeviceWrite(addr, val);
+      return;
+    }
+    if (!in_isr_) CheckedFault("store", addr);
+  }
+
+  // Checked-mode violation. Exit hard with the faulting PC: this mode
+  // exists to pin down exactly one stray access, so limping on with a
+  // warning would bury it. kRPC already moved past the instruction.
+  LC3_COLD void CheckedFault(const char *kind, u16 addr) {
+    FlushOutput();
+    RestoreInputBuffering();
+    fprintf(stderr, "checked: %s x%04X at pc x%04X (below x%04X)\n", kind, addr,
+            (u16)(reg_[kRPC] - 1), kUserBase);
+    exit(-3);
+  }
+
+  // Cold side of MemWrite: stores that land in the device page.
+  LC3_COLD void DeviceWrite(u16 addr, u16 val) {
+    if (prof_) ++prof_->mmio_writes;
+    if (addr == kBankSelect) SwitchBank(val);
+    if (addr == kDmaCtl) RunDma();
+    if (addr == kKeyboardStatus && (val & kKbIntEnable) && !batch_ && !bench_io_) {
+      if (rec_buf_ || replay_) {
+        // Interrupt delivery rides on live key arrival timing, which the
+        // trace format doesn't capture: ServiceInterrupt pops the queue
+        // without logging and a replay would have nothing to feed it. An
+        // armed KBSR[14] would silently break the re-execute-bit-identically
+        // guarantee, so the arm is refused -- the bit reads back clear,
+        // leaving such a guest the polling path, which is logged.
+        static bool warned = false;
+        if (!warned) {
+          warned = true;
+          fprintf(stderr, "lc3: keyboard interrupts can't be recorded; KBSR[14] stays clear\n");
+        }
+        memory_[kKeyboardStatus] = val & (u16)~kKbIntEnable;
+        return;
       }
-      case kOpSti: {
-        u16 addr = reg_[kRPC] + SignExtend(instr & 0x1FF, 9);
-        memory_[MemRead(addr)] = reg_[R0(instr)];
-        break;
+      // Interrupt-driven guests never poll, so enabling KBSR[14] is what
+      // starts the reader thread; queued keys raise the pending counter.
+      if (StartKeyboard()) {
+        keys_->pending.store(&intr_pending_, std::memory_order_release);
+        if (!keys_->Empty()) intr_pending_.fetch_add(1, std::memory_order_release);
       }
-      case kOpStr: {
-        u16 addr = reg_[R1(instr)] + SignExtend(instr & 0x3F, 6);
-        memory_[addr] = reg_[R0(instr)];
+    }
+  }
+
+  // RAM-range clamp shared by DMA and the block-op traps: the device
+  // page is neither source nor destination for bulk operations.
+  static u32 ClampRange(u16 start, u32 len) {
+    if (start >= kDeviceBase) return 0;
+    if ((u32)start + len > kDeviceBase) return kDeviceBase - start;
+    return len;
+  }
+
+  // Bulk stores bypass MemWrite, so drop the decode entries (and any
+  // compiled block) over the written range.
+  void InvalidateRange(u16 start, u32 len) {
+    if (len == 0) return;
+    decoded_[(u16)(start - 1)].uop = kUopMiss;  // fused pair into the range
+    for (u32 i = 0; i < len; ++i) decoded_[start + i].uop = kUopMiss;
+    for (u32 p = start >> kPageShift; p <= (u32)(start + len - 1) >> kPageShift; ++p)
+      page_dirty_[p] = 1;
+  }
+
+  // DMA block transfer: moves kDmaLen words between memory_ at kDmaAddr
+  // and the input/output fd in bulk syscalls on the raw word bytes, so
+  // data images stop shoveling a character per GETC/OUT trap. The range
+  // is clamped to RAM (the device page is not a DMA target); guest-bound
+  // transfers invalidate the touched decode entries since the data may
+  // overwrite code. kDmaCtl reads back as the word count actually moved.
+  LC3_COLD void RunDma() {
+    u16 dst = memory_[kDmaAddr];
+    u32 len = ClampRange(dst, memory_[kDmaLen]);
+    memory_[kDmaCtl] = 0;
+    u8 *p = (u8 *)(memory_ + dst);
+    usize want = len * sizeof(u16);
+    usize moved = 0;
+    if (memory_[kDmaDir] == 0) {  // host -> guest
+      while (moved < want) {
+        i64 n = read(in_fd_, p + moved, want - moved);
+        if (n <= 0) break;
+        moved += (usize)n;
+      }
+      InvalidateRange(dst, (u32)((moved + 1) / sizeof(u16)));
+    } else {  // guest -> host
+      FlushOutput();  // keep ordering with trap console output on this fd
+      if (outq_)      // and let the writer thread drain before we bypass it
+        while (!outq_->Empty()) usleep(100);
+      while (moved < want) {
+        i64 n = write(out_fd_, p + moved, want - moved);
+        if (n <= 0) break;
+        moved += (usize)n;
+      }
+    }
+    memory_[kDmaCtl] = (u16)(moved / sizeof(u16));
+  }
+
+  // Delivers a pending keyboard interrupt between two instructions:
+  // loads KBDR, pushes the condition mask and return PC on the stack at
+  // R6, and vectors through IVT entry 0x80. One level deep, as on the
+  // real machine; further keys re-raise the counter and wait for RTI.
+  // The counter is advisory -- a raise lost to a racing keystroke is
+  // recovered by the next one (or by the guest falling back to polling).
+  LC3_COLD void ServiceInterrupt() {
+    if (in_isr_) return;  // redelivered after RTI; counter stays raised
+    intr_pending_.store(0, std::memory_order_relaxed);
+    if (!(memory_[kKeyboardStatus] & kKbIntEnable) || !keys_ || keys_->Empty()) return;
+    memory_[kKeyboardData] = keys_->Pop();
+    memory_[kKeyboardStatus] |= kKbReady;
+    if (!keys_->Empty()) intr_pending_.store(1, std::memory_order_relaxed);
+    in_isr_ = true;  // before the pushes: the supervisor stack is fair game now
+    MemWrite(--reg_[kR6], CondMask());
+    MemWrite(--reg_[kR6], reg_[kRPC]);
+    reg_[kRPC] = memory_[(u16)(kIvtBase + kKeyboardVector)];
+  }
+
+  // Banked memory. The first write to kBankSelect creates a memfd of
+  // kBankCnt banks and seeds bank 0 with whatever the window held, so
+  // turning banking on is transparent. Every switch after that is one
+  // MAP_FIXED mmap repointing the window's host pages at the chosen
+  // bank: loads, stores and the JIT keep the flat memory_ indexing (the
+  // MMU is the indirection) and unbanked guests never pay anything. The
+  // outgoing bank may have held code, so the window's decoded entries
+  // (and any compiled block touching it) are dropped.
+  LC3_COLD void SwitchBank(u16 idx) {
+    if (idx >= kBankCnt || (int)idx == cur_bank_) return;
+    const usize bank_bytes = kBankWords * sizeof(u16);
+    if (bank_fd_ < 0) {
+      int fd = memfd_create("lc3-banks", 0);
+      if (fd < 0) return;
+      if (ftruncate(fd, (i64)kBankCnt * bank_bytes) != 0 ||
+          pwrite(fd, memory_ + kBankWindow, bank_bytes, 0) != (i64)bank_bytes) {
+        close(fd);
+        return;
+      }
+      bank_fd_ = fd;
+    }
+    void *m = mmap(memory_ + kBankWindow, bank_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, bank_fd_, (i64)idx * bank_bytes);
+    if (m == MAP_FAILED) return;
+    cur_bank_ = idx;
+    InvalidateRange(kBankWindow, kBankWords);
+  }
+
+  // The dispatch loop proper; Run and Step pick the instantiation.
+  // kProfile compiles the counters in, kSliced the timeslice budget and
+  // yield points, kBatchIo swaps the keyboard traps for plain fd reads
+  // (see SetBatch), kTrace emits one ItraceRec per retired instruction;
+  // <false, false, false, false> is bit-identical to the old loop.
+  template <bool kProfile, bool kSliced, bool kBatchIo, bool kTrace>
+  void RunLoop();
+
+  void Decode(u16 pc);
+
+  // Predecode a loaded range so the first pass through a loop already
+  // runs from the cache. Data words decode to whatever their bits say,
+  // which is exactly what executing them would have done anyway.
+  void PredecodeRange(u16 origin, usize words) {
+    for (usize i = 0; i < words; ++i) Decode(origin + i);
+  }
+
+  bool LoadImageCache(const char *cache_path, const struct stat &src);
+  bool LoadLc3x(int fd, const struct stat &st);
+  void WriteImageCache(const char *cache_path, const struct stat &src, u16 origin, usize words);
+
+#ifdef LC3_JIT
+  typedef void (*JitBlock)(VM *);
+
+  void JitNote(u16 target);
+  void JitCompile(u16 start);
+  void JitFlush();
+  LC3_COLD void JitVetDirty();
+#endif
+
+  u16 *memory_;  // kMemBytes mapping; see the constructor and AttachMemory
+  int bank_fd_ = -1;   // kBankCnt banks; created on the first kBankSelect write
+  int cur_bank_ = -1;  // bank mapped at kBankWindow, -1 = unbanked
+  u16 reg_[kRegCnt] = {0};
+  u16 cc_ = 0;  // last flag-setting result; see SetCc/CondMask
+  u64 instr_count_ = 0;  // retired micro-ops; read back through the timer device
+  PageReadFn page_read_[kPageCnt];
+  u8 page_dirty_[kPageCnt] = {};  // pages stored to; consumed at JIT block entry
+  u16 store_guard_ = 0;  // store slow-path floor: 0, or kUserBase under --checked
+  char out_buf_[8192];
+  usize out_len_ = 0;
+  bool unbuffered_ = false;
+  bool bench_io_ = false;
+  bool batch_ = false;  // no keyboard; see SetBatch
+  bool ext_traps_ = false;  // extension traps armed; see EnableExtTraps
+  OutQueue *outq_ = NULL;  // non-NULL when output is pipelined
+  pthread_t out_thread_;
+  int in_fd_ = STDIN_FILENO;
+  int out_fd_ = STDOUT_FILENO;
+  std::atomic<u32> intr_pending_{0};  // fused "anything pending" counter
+  bool in_isr_ = false;               // between interrupt entry and RTI
+  bool sliced_ = false;       // running under Step
+  bool started_ = false;      // registers initialized
+  bool halted_ = false;
+  i64 slice_budget_ = 0;
+  VmRunState slice_state_ = kVmReady;
+  const char *snapshot_path_ = NULL;
+  bool restored_ = false;  // resume from snapshot registers, not 0x3000
+  TraceEvent *rec_buf_ = NULL;  // recording arena; non-NULL while recording
+  std::atomic<u32> rec_len_{0};
+  std::atomic<bool> rec_stop_{false};
+  pthread_t rec_thread_;
+  int rec_fd_ = -1;
+  TraceEvent *rep_buf_ = NULL;  // loaded trace; non-NULL while replaying
+  u32 rep_len_ = 0;
+  u32 rep_pos_ = 0;
+  bool replay_ = false;
+  ItraceRec *itrace_buf_[2] = {NULL, NULL};  // double buffer; [0] non-NULL while tracing
+  u32 itrace_len_ = 0;
+  int itrace_cur_ = 0;
+  int itrace_fd_ = -1;
+  int itrace_pending_ = -1;  // arena index handed to the writer, -1 when none
+  u32 itrace_pending_len_ = 0;
+  std::atomic<bool> itrace_stop_{false};
+  pthread_t itrace_thread_;
+  pthread_mutex_t itrace_mu_;
+  pthread_cond_t itrace_data_, itrace_space_;
+  Profile *prof_ = NULL;
+  bool profile_dump_ = false;
+  KeyQueue *keys_ = NULL;
+  bool kb_failed_ = false;
+  u32 kb_idle_polls_ = 0;
+  // Indexed by the full u16 PC, hence one entry more than memory_.
+  Decoded decoded_[kMaxMemory + 1] = {};
+
+#ifdef LC3_JIT
+  JitBlock jit_blocks_[kMaxMemory + 1] = {};
+  u8 jit_hot_[kMaxMemory + 1] = {};
+  u8 jit_span_[kMaxMemory + 1] = {};  // addresses covered by compiled code
+  u16 jit_starts_[kJitMaxBlocks];
+  int jit_start_cnt_ = 0;
+  u8 *jit_buf_ = NULL;
+  usize jit_used_ = 0;
+  bool jit_disabled_ = false;
+#endif
+};
+
+namespace {
+
+// SIGUSR1 dumps the live profile of the running VM, in the same spirit as
+// HandleInterrupt above: the handler does the printing directly, which is
+// fine for a single-threaded diagnostic hook.
+VM *g_profile_vm = NULL;
+
+void HandleProfileDump(int signal) { (void)signal;
+  if (g_profile_vm) g_profile_vm->DumpProfile();
+}
+
+}  // namespace
+
+// Out-of-line half of HandleInterrupt, which is declared before the class.
+void FlushSigintVm() {
+  if (g_sigint_vm) g_sigint_vm->FlushOnSignal();
+}
+
+// The report goes to stderr so it never interleaves with guest console
+// output (SIGUSR1 can land mid-run).
+void VM::DumpProfile() const {
+  if (!prof_) return;
+  const Profile &p = *prof_;
+
+  u64 dispatches = 0, instrs = 0;
+  for (int u = 0; u < kUopCnt; ++u) dispatches += p.uop_counts[u];
+  for (int u = kUopBr; u < kUopCnt; ++u) instrs += p.uop_counts[u];
+  instrs += p.uop_counts[kUopAddIBr] + p.uop_counts[kUopNeg] + p.uop_counts[kUopLdAdd];
+
+  fprintf(stderr, "== lc3 profile ==\n");
+  fprintf(stderr, "instructions: %llu (dispatches: %llu)\n",
+          (unsigned long long)instrs, (unsigned long long)dispatches);
+
+  fprintf(stderr, "uops:");
+  for (int u = 0; u < kUopCnt; ++u) {
+    if (p.uop_counts[u]) {
+      fprintf(stderr, " %s=%llu", kUopNames[u], (unsigned long long)p.uop_counts[u]);
+    }
+  }
+  fprintf(stderr, "\n");
+
+  fprintf(stderr, "traps:");
+  for (int t = 0; t < 256; ++t) {
+    if (p.trap_counts[t]) {
+      fprintf(stderr, " x%02X=%llu", t, (unsigned long long)p.trap_counts[t]);
+    }
+  }
+  fprintf(stderr, "\nmmio: reads=%llu writes=%llu\n",
+          (unsigned long long)p.mmio_reads, (unsigned long long)p.mmio_writes);
+
+  // Top PC-hit buckets: the guest's hot loops.
+  fprintf(stderr, "hot pcs:\n");
+  u32 picked[16];
+  int npicked = 0;
+  for (int n = 0; n < 16; ++n) {
+    u64 best = 0;
+    u32 best_pc = 0;
+    for (u32 a = 0; a <= kMaxMemory; ++a) {
+      if (p.pc_hits[a] <= best) continue;
+      bool used = false;
+      for (int i = 0; i < npicked; ++i) used |= picked[i] == a;
+      if (used) continue;
+      best = p.pc_hits[a];
+      best_pc = a;
+    }
+    if (best == 0) break;
+    picked[npicked++] = best_pc;
+    fprintf(stderr, "  x%04X: %llu\n", best_pc, (unsigned long long)best);
+  }
+}
+
+void VM::Decode(u16 pc) {
+  u16 instr = memory_[pc];
+  Decoded d = {};
+  switch (instr >> 12) {
+    case kOpAdd:
+      d.r0 = R0(instr);
+      d.r1 = R1(instr);
+      if ((instr >> 5) & 0x1) {
+        d.uop = kUopAddI;
+        d.imm = SignExtend(instr & 0x1F, 5);
+      } else {
+        d.uop = kUopAddR;
+        d.r2 = R2(instr);
+      }
+      break;
+    case kOpAnd:
+      d.r0 = R0(instr);
+      d.r1 = R1(instr);
+      if ((instr >> 5) & 0x1) {
+        d.uop = kUopAndI;
+        d.imm = SignExtend(instr & 0x1F, 5);
+      } else {
+        d.uop = kUopAndR;
+        d.r2 = R2(instr);
+      }
+      break;
+    case kOpBr:
+      d.uop = kUopBr;
+      d.r0 = (instr >> 9) & 0x7;  // condition mask, not a register
+      d.imm = SignExtend(instr & 0x1FF, 9);
+      break;
+    case kOpJmp:
+      d.uop = kUopJmp;
+      d.r1 = R1(instr);
+      break;
+    case kOpJsr:
+      if ((instr >> 11) & 0x1) {
+        d.uop = kUopJsrI;
+        d.imm = SignExtend(instr & 0x7FF, 11);
+      } else {
+        d.uop = kUopJsrR;
+        d.r1 = R1(instr);
+      }
+      break;
+    case kOpLd:
+      d.uop = kUopLd;
+      d.r0 = R0(instr);
+      d.imm = SignExtend(instr & 0x1FF, 9);
+      break;
+    case kOpLdi:
+      d.uop = kUopLdi;
+      d.r0 = R0(instr);
+      d.imm = SignExtend(instr & 0x1FF, 9);
+      break;
+    case kOpLdr:
+      d.uop = kUopLdr;
+      d.r0 = R0(instr);
+      d.r1 = R1(instr);
+      d.imm = SignExtend(instr & 0x3F, 6);
+      break;
+    case kOpLea:
+      d.uop = kUopLea;
+      d.r0 = R0(instr);
+      d.imm = SignExtend(instr & 0x1FF, 9);
+      break;
+    case kOpNot:
+      d.uop = kUopNot;
+      d.r0 = R0(instr);
+      d.r1 = R1(instr);
+      break;
+    case kOpSt:
+      d.uop = kUopSt;
+      d.r0 = R0(instr);
+      d.imm = SignExtend(instr & 0x1FF, 9);
+      break;
+    case kOpSti:
+      d.uop = kUopSti;
+      d.r0 = R0(instr);
+      d.imm = SignExtend(instr & 0x1FF, 9);
+      break;
+    case kOpStr:
+      d.uop = kUopStr;
+      d.r0 = R0(instr);
+      d.r1 = R1(instr);
+      d.imm = SignExtend(instr & 0x3F, 6);
+      break;
+    case kOpTrap:
+      d.uop = kUopTrap;
+      d.imm = instr & 0xFF;
+      break;
+    case kOpRti:
+      d.uop = kUopRti;
+      break;
+    default:  // kOpRes
+      d.uop = kUopBad;
+      break;
+  }
+
+  // Superinstruction fusion: LC-3 compilers emit very predictable pairs
+  // (see the loop idiom in the header comment), and fusing them halves
+  // dispatch and flag-update work on loop back-edges. The second word
+  // keeps its own independent entry, so branching into the middle of a
+  // pair still works; MemWrite invalidates both words' entries.
+  u16 next = memory_[(u16)(pc + 1)];
+  switch (d.uop) {
+    case kUopAddI:
+      if ((next >> 12) == kOpBr && ((next >> 9) & 0x7) != 0) {
+        d.uop = kUopAddIBr;
+        d.r2 = (next >> 9) & 0x7;
+        d.imm2 = SignExtend(next & 0x1FF, 9);
+      }
+      break;
+    case kUopNot:
+      if (next == (u16)(0x1021 | (d.r0 << 9) | (d.r0 << 6))) {  // ADD r0, r0, #1
+        d.uop = kUopNeg;
+      }
+      break;
+    case kUopLd:
+      if ((next >> 12) == kOpAdd && !((next >> 5) & 0x1)) {
+        u16 dr = R0(next);
+        u16 sr1 = R1(next);
+        u16 sr2 = R2(next);
+        if (sr1 == d.r0 || sr2 == d.r0) {
+          d.r2 = d.r0;  // the load target (ADD is commutative)
+          d.r1 = sr2 == d.r0 ? sr1 : sr2;
+          d.r0 = dr;
+          d.uop = kUopLdAdd;
+        }
+      }
+      break;
+  }
+
+  decoded_[pc] = d;
+}
+
+// mmap-based loader for fleet use: the image is mapped read-only and
+// converted straight into memory_, and the converted payload is written
+// to a <path>.lc3c sidecar so the next start of the same image skips the
+// byte swap entirely (memory_ lives inside the VM object, so the warm
+// path is one copy from the mapped sidecar rather than a remap).
+bool VM::LoadImageMapped(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (i64)sizeof(u16)) {
+    close(fd);
+    return false;
+  }
+
+  // A precompiled container identifies itself by magic; everything else
+  // goes down the classic .obj route. An .obj whose leading bytes happen
+  // to spell the magic would still have to pass the header validation in
+  // LoadLc3x, so a collision fails loudly rather than loading garbage.
+  if (st.st_size >= (i64)sizeof(Lc3xHeader)) {
+    u32 magic = 0;
+    if (pread(fd, &magic, sizeof(magic), 0) == (i64)sizeof(magic) && magic == kLc3xMagic) {
+      return LoadLc3x(fd, st);
+    }
+  }
+  if (st.st_size > kMaxMemory) {
+    close(fd);
+    return false;
+  }
+
+  char cache_path[4096];
+  snprintf(cache_path, sizeof(cache_path), "%s.lc3c", path);
+  if (LoadImageCache(cache_path, st)) {
+    close(fd);
+    return true;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const u8 *p = (const u8 *)map;
+  u16 origin = (u16)((p[0] << 8) | p[1]);
+  usize words = (st.st_size - sizeof(u16)) / sizeof(u16);
+  if (origin + words > kMaxMemory) {  // would convert past the backing
+    munmap(map, st.st_size);
+    return false;
+  }
+  SwapCopy(memory_ + origin, p + sizeof(u16), words);
+  munmap(map, st.st_size);
+
+  PredecodeRange(origin, words);
+  WriteImageCache(cache_path, st, origin, words);
+  return true;
+}
+
+bool VM::LoadImageCache(const char *cache_path, const struct stat &src) {
+  int fd = open(cache_path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (i64)sizeof(ImageCacheHeader)) {
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const ImageCacheHeader *h = (const ImageCacheHeader *)map;
+  bool ok = h->magic == kImageCacheMagic && h->src_size == src.st_size &&
+            h->src_mtime == src.st_mtime &&
+            (usize)st.st_size == sizeof(*h) + h->words * sizeof(u16) &&
+            (usize)h->origin + h->words <= kMaxMemory;
+  if (ok) {
+    memcpy(memory_ + h->origin, h + 1, h->words * sizeof(u16));
+    PredecodeRange(h->origin, h->words);
+  }
+  munmap(map, st.st_size);
+  return ok;
+}
+
+// Best effort: a read-only image directory just means every start is a
+// cold start.
+void VM::WriteImageCache(const char *cache_path, const struct stat &src, u16 origin,
+                         usize words) {
+  int fd = open(cache_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return;
+
+  ImageCacheHeader h = {};
+  h.magic = kImageCacheMagic;
+  h.origin = origin;
+  h.words = words;
+  h.src_size = src.st_size;
+  h.src_mtime = src.st_mtime;
+  bool ok = write(fd, &h, sizeof(h)) == (i64)sizeof(h) &&
+            write(fd, memory_ + origin, words * sizeof(u16)) == (i64)(words * sizeof(u16));
+  close(fd);
+  if (!ok) unlink(cache_path);
+}
+
+bool VM::CompileLc3x(const char *in_path, const char *out_path) {
+  int fd = open(in_path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (i64)sizeof(u16) || st.st_size > kMaxMemory) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const u8 *p = (const u8 *)map;
+  u16 origin = (u16)((p[0] << 8) | p[1]);
+  usize words = (st.st_size - sizeof(u16)) / sizeof(u16);
+  if (origin + words > kMaxMemory) {  // same bound the loaders enforce
+    munmap(map, st.st_size);
+    return false;
+  }
+  SwapCopy(memory_ + origin, p + sizeof(u16), words);
+  munmap(map, st.st_size);
+  PredecodeRange(origin, words);
+
+  // Static control-flow targets inside the image become the block index.
+  // JSR-through-register and RET targets aren't knowable here; those
+  // blocks still warm up the usual way at run time.
+  u8 *seen = (u8 *)calloc(kMaxMemory + 1, 1);
+  u16 *blocks = (u16 *)malloc(words * sizeof(u16));
+  u32 nblocks = 0;
+  for (usize i = 0; i < words; ++i) {
+    u16 pc = (u16)(origin + i);
+    const Decoded *d = &decoded_[pc];
+    u16 target;
+    switch (d->uop) {
+      case kUopBr:
+        target = (u16)(pc + 1 + d->imm);
+        break;
+      case kUopAddIBr:
+        target = (u16)(pc + 2 + d->imm2);
+        break;
+      case kUopJsrI:
+        target = (u16)(pc + 1 + d->imm);
+        break;
+      default:
+        continue;
+    }
+    if (target < origin || target >= origin + words) continue;
+    if (seen[target]) continue;
+    seen[target] = 1;
+    blocks[nblocks++] = target;
+  }
+
+  Lc3xHeader h = {};
+  h.magic = kLc3xMagic;
+  h.uop_cnt = kUopCnt;
+  h.origin = origin;
+  h.words = words;
+  h.nblocks = nblocks;
+  fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0 &&
+            write(fd, &h, sizeof(h)) == (i64)sizeof(h) &&
+            write(fd, memory_ + origin, words * sizeof(u16)) == (i64)(words * sizeof(u16)) &&
+            write(fd, decoded_ + origin, words * sizeof(Decoded)) ==
+                (i64)(words * sizeof(Decoded)) &&
+            write(fd, blocks, nblocks * sizeof(u16)) == (i64)(nblocks * sizeof(u16));
+  if (fd >= 0) close(fd);
+  if (!ok && fd >= 0) unlink(out_path);
+  free(blocks);
+  free(seen);
+  return ok;
+}
+
+bool VM::LoadLc3x(int fd, const struct stat &st) {
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const Lc3xHeader *h = (const Lc3xHeader *)map;
+  bool ok = h->magic == kLc3xMagic && h->uop_cnt == kUopCnt &&
+            (usize)h->origin + h->words <= kMaxMemory &&
+            (usize)st.st_size == sizeof(*h) + h->words * (sizeof(u16) + sizeof(Decoded)) +
+                                     h->nblocks * sizeof(u16);
+  const u8 *payload = (const u8 *)(h + 1);
+  if (ok) {
+    // The Decoded stream indexes the dispatch table and reg_[] with no
+    // further checks, so vet every entry the way the header is vetted:
+    // Decode never emits a field above 7 or a kUopJit, and a file that
+    // does is corrupt and gets rejected whole.
+    const Decoded *dec = (const Decoded *)(payload + h->words * sizeof(u16));
+    for (u32 i = 0; ok && i < h->words; ++i) {
+      ok = dec[i].uop < kUopCnt && dec[i].uop != kUopJit &&
+           dec[i].r0 <= 7 && dec[i].r1 <= 7 && dec[i].r2 <= 7;
+    }
+  }
+  if (ok) {
+    memcpy(memory_ + h->origin, payload, h->words * sizeof(u16));
+    memcpy(decoded_ + h->origin, payload + h->words * sizeof(u16),
+           h->words * sizeof(Decoded));
+#ifdef LC3_JIT
+    // Pre-warm the hotness counters: the first entry into an indexed
+    // block compiles it instead of the kJitThreshold'th.
+    const u16 *blocks = (const u16 *)(payload + h->words * (sizeof(u16) + sizeof(Decoded)));
+    for (u32 i = 0; i < h->nblocks; ++i) jit_hot_[blocks[i]] = kJitThreshold - 1;
+#endif
+  }
+  munmap(map, st.st_size);
+  return ok;
+}
+
+bool VM::SaveSnapshot(int fd) {
+  SnapshotHeader h = {};
+  h.magic = kSnapshotMagic;
+  memcpy(h.reg, reg_, sizeof(h.reg));
+  h.cc = cc_;
+  if (lseek(fd, 0, SEEK_SET) < 0) return false;
+  if (write(fd, &h, sizeof(h)) != (i64)sizeof(h)) return false;
+  if (lseek(fd, kSnapshotMemOff, SEEK_SET) < 0) return false;
+  return write(fd, memory_, kMemBytes) == (i64)kMemBytes;
+}
+
+bool VM::RestoreSnapshot(int fd) {
+  SnapshotHeader h;
+  if (read(fd, &h, sizeof(h)) != (i64)sizeof(h)) return false;
+  if (h.magic != kSnapshotMagic) return false;
+  if (lseek(fd, kSnapshotMemOff, SEEK_SET) < 0) return false;
+  if (read(fd, memory_, kMemBytes) != (i64)kMemBytes) return false;
+  memcpy(reg_, h.reg, sizeof(reg_));
+  cc_ = h.cc;
+  restored_ = true;
+  // Any decode state from a previously loaded image is stale now; the
+  // cache refills lazily as the restored guest executes.
+  memset(decoded_, 0, sizeof(decoded_));
+#ifdef LC3_JIT
+  JitFlush();
+#endif
+  return true;
+}
+
+#ifdef LC3_JIT
+
+namespace {
+
+bool JitSupported(u16 uop) {
+  switch (uop) {
+    case kUopNeg:
+    case kUopLdAdd:
+    case kUopAddR:
+    case kUopAddI:
+    case kUopAndR:
+    case kUopAndI:
+    case kUopNot:
+    case kUopLea:
+    case kUopLd:
+    case kUopLdi:
+    case kUopLdr:
+    case kUopSt:
+    case kUopSti:
+    case kUopStr:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Sets reg_[kRPC] to `pc` and returns to the dispatch loop.
+void EmitExitAt(CodeBuf &c, u32 pc_off, u16 pc) {
+  c.StoreImm16(pc_off, pc);
+  c.Ret();
+}
+
+// Records the 16-bit result in eax as the lazy condition value (cc_);
+// the interpreter derives the N/Z/P mask when a branch consumes it.
+void EmitFlags(CodeBuf &c, u32 cc_off) { c.StoreWord(0, cc_off); }
+
+// Guards the load address in eax: anything in the device page exits the
+// block so the interpreter replays the load through MemRead.
+void EmitLoadGuard(CodeBuf &c, u32 pc_off, u16 pc) {
+  c.CmpImm(0, kDeviceBase);
+  usize j = c.Jcc8(0x72);  // jb
+  EmitExitAt(c, pc_off, pc);
+  c.PatchTo(j);
+}
+
+// Guards the store address in ecx: a store into the device page exits
+// the block so MemWrite can run the register's side effects (bank
+// switches), and a store into an address covered by compiled code exits
+// so MemWrite can flush the cache.
+void EmitStoreGuard(CodeBuf &c, u32 span_off, u32 pc_off, u16 pc) {
+  c.CmpImm(1, kDeviceBase);  // device-page stores have side effects
+  usize j1 = c.Jcc8(0x72);   // jb
+  EmitExitAt(c, pc_off, pc);
+  c.PatchTo(j1);
+  c.CmpByteIdx(1, span_off);
+  usize j2 = c.Jcc8(0x74);  // je
+  EmitExitAt(c, pc_off, pc);
+  c.PatchTo(j2);
+}
+
+// Clears the decoded entries for the store target in ecx and for the word
+// before it, which may head a fused pair covering the target. Clobbers
+// ecx and edx, so it has to be the last thing a store emits.
+void EmitInvalidate(CodeBuf &c, u32 dec_off, u32 dirty_off, u32 idle_off) {
+  c.MovReg(2, 1);  // page_dirty_[addr >> kPageShift] = 1
+  c.ShrImm(2, kPageShift);
+  c.StoreByteIdx(2, dirty_off, 1);
+  c.LeaTimes3(2, 1);
+  c.StoreImm16Idx4(2, dec_off, kUopMiss);
+  c.SubImm8(1, 1);
+  c.Trunc(1);
+  c.LeaTimes3(2, 1);
+  c.StoreImm16Idx4(2, dec_off, kUopMiss);
+  // Mirror MemWrite's kb_idle_polls_ reset: the idle-park heuristic
+  // reads "no intervening stores", and a store that only ever runs from
+  // compiled code must count too or a working guest parks on the queue.
+  c.StoreImm32(idle_off, 0);
+}
+
+}  // namespace
+
+void VM::JitNote(u16 target) {
+  if (jit_disabled_ || jit_blocks_[target]) return;
+  if (jit_hot_[target] == 0xFF) return;
+  if (++jit_hot_[target] == kJitThreshold) {
+    jit_hot_[target] = 0xFF;  // one compile attempt per flush generation
+    JitCompile(target);
+  }
+}
+
+void VM::JitFlush() {
+  for (int i = 0; i < jit_start_cnt_; ++i) {
+    u16 s = jit_starts_[i];
+    jit_blocks_[s] = NULL;
+    decoded_[s].uop = kUopMiss;
+  }
+  jit_start_cnt_ = 0;
+  jit_used_ = 0;
+  memset(jit_span_, 0, sizeof(jit_span_));
+  memset(jit_hot_, 0, sizeof(jit_hot_));
+}
+
+// A store touched a page that carries compiled code (or merely shares
+// one with it). Re-hash every block on a dirty page: a mismatch is
+// real self-modification and drops just that block, while data stores
+// that share the page leave their neighbours standing -- LC-3 images
+// routinely keep .FILL data on the same 256-word page as the loop that
+// stores to it, and flushing the world here made such loops recompile
+// forever. The dirty map clears only after every block has been vetted
+// against it, so a stale sibling on the same page can't slip through.
+LC3_COLD void VM::JitVetDirty() {
+  for (int i = 0; i < jit_start_cnt_; ++i) {
+    u16 s = jit_starts_[i];
+    if (!jit_blocks_[s]) continue;  // dropped by an earlier vet
+    Decoded *b = &decoded_[s];
+    bool live = b->uop == kUopJit;  // start word itself stored over otherwise
+    if (live && !(page_dirty_[b->r1] | page_dirty_[b->r2])) continue;
+    u32 hash = 2166136261u;
+    if (live) {
+      for (u16 n = 0; n < b->imm; ++n) hash = (hash ^ memory_[(u16)(s + n)]) * 16777619u;
+    }
+    if (!live || (u16)hash != b->imm2 || (u16)(hash >> 16) != b->r0) {
+      jit_blocks_[s] = NULL;
+      if (live) b->uop = kUopMiss;
+      jit_hot_[s] = 0;  // a rewritten loop may warm up and recompile
+      // jit_span_ stays set: blocks can overlap, and a spurious
+      // store-guard exit is just a slow store.
+    }
+  }
+  memset(page_dirty_, 0, sizeof(page_dirty_));
+}
+
+void VM::JitCompile(u16 start) {
+  if (!jit_buf_) {
+    void *buf = mmap(NULL, kJitBufSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+      jit_disabled_ = true;
+      return;
+    }
+    jit_buf_ = (u8 *)buf;
+  }
+  // Vet-dropped blocks leave dead slots and dead code behind; when
+  // either table fills, retire the whole generation and start fresh
+  // rather than never compiling again.
+  if (jit_start_cnt_ == kJitMaxBlocks ||
+      jit_used_ + (usize)kJitMaxBlockLen * kJitMaxInstrBytes + 16 > kJitBufSize) {
+    JitFlush();
+  }
+
+  // Collect the straight-line run of compilable micro-ops.
+  u16 pcs[kJitMaxBlockLen];
+  int len = 0;
+  u16 pc = start;
+  while (len < kJitMaxBlockLen) {
+    if (decoded_[pc].uop == kUopMiss) Decode(pc);
+    u16 uop = decoded_[pc].uop;
+    if (!JitSupported(uop)) break;
+    pcs[len++] = pc;
+    pc += (uop == kUopNeg || uop == kUopLdAdd) ? 2 : 1;  // fused pairs span two words
+  }
+  if (len < 2) return;  // not worth a call through a code pointer
+  if (jit_used_ + (usize)len * kJitMaxInstrBytes + 16 > kJitBufSize) return;
+
+  const u32 off_mem = offsetof(VM, memory_);
+  const u32 off_dec = offsetof(VM, decoded_);
+  const u32 off_span = offsetof(VM, jit_span_);
+  const u32 off_dirty = offsetof(VM, page_dirty_);
+  const u32 off_idle = offsetof(VM, kb_idle_polls_);
+  const u32 off_cond = offsetof(VM, cc_);
+  const u32 off_pc = offsetof(VM, reg_) + sizeof(u16) * kRPC;
+  auto reg_off = [](u16 r) -> u32 { return offsetof(VM, reg_) + sizeof(u16) * r; };
+
+  CodeBuf c = {jit_buf_ + jit_used_, jit_buf_ + jit_used_};
+  for (int i = 0; i < len; ++i) {
+    const Decoded &d = decoded_[pcs[i]];
+    u16 next = pcs[i] + 1;
+    switch (d.uop) {
+      case kUopAddR:
+        c.LoadWord(0, reg_off(d.r1));
+        c.LoadWord(1, reg_off(d.r2));
+        c.Add(0, 1);
+        c.Trunc(0);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopAddI:
+        c.LoadWord(0, reg_off(d.r1));
+        c.AddImm(0, d.imm);
+        c.Trunc(0);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
         break;
+      case kUopAndR:
+        c.LoadWord(0, reg_off(d.r1));
+        c.LoadWord(1, reg_off(d.r2));
+        c.And(0, 1);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopAndI:
+        c.LoadWord(0, reg_off(d.r1));
+        c.AndImm(0, d.imm);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopNot:
+        c.LoadWord(0, reg_off(d.r1));
+        c.Not(0);
+        c.Trunc(0);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopLea:
+        c.MovImm(0, (u16)(next + d.imm));
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopLd:
+        c.MovImm(0, (u16)(next + d.imm));
+        EmitLoadGuard(c, off_pc, pcs[i]);
+        c.LoadPtr(2, off_mem);
+        c.LoadWordIdxAt(0, 0, 2);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopLdi:
+        c.MovImm(0, (u16)(next + d.imm));
+        EmitLoadGuard(c, off_pc, pcs[i]);
+        c.LoadPtr(2, off_mem);
+        c.LoadWordIdxAt(0, 0, 2);
+        EmitLoadGuard(c, off_pc, pcs[i]);
+        c.LoadWordIdxAt(0, 0, 2);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopLdr:
+        c.LoadWord(0, reg_off(d.r1));
+        c.AddImm(0, d.imm);
+        c.Trunc(0);
+        EmitLoadGuard(c, off_pc, pcs[i]);
+        c.LoadPtr(2, off_mem);
+        c.LoadWordIdxAt(0, 0, 2);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopSt:
+        c.MovImm(1, (u16)(next + d.imm));
+        c.LoadWord(0, reg_off(d.r0));
+        EmitStoreGuard(c, off_span, off_pc, pcs[i]);
+        c.LoadPtr(2, off_mem);
+        c.StoreWordIdxAt(0, 1, 2);
+        EmitInvalidate(c, off_dec, off_dirty, off_idle);
+        break;
+      case kUopSti:
+        c.MovImm(0, (u16)(next + d.imm));
+        EmitLoadGuard(c, off_pc, pcs[i]);
+        c.LoadPtr(2, off_mem);
+        c.LoadWordIdxAt(1, 0, 2);
+        c.LoadWord(0, reg_off(d.r0));
+        EmitStoreGuard(c, off_span, off_pc, pcs[i]);
+        c.StoreWordIdxAt(0, 1, 2);
+        EmitInvalidate(c, off_dec, off_dirty, off_idle);
+        break;
+      case kUopNeg:
+        c.LoadWord(0, reg_off(d.r1));
+        c.Not(0);
+        c.AddImm(0, 1);
+        c.Trunc(0);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopLdAdd:
+        c.MovImm(0, (u16)(next + d.imm));
+        EmitLoadGuard(c, off_pc, pcs[i]);
+        c.LoadPtr(2, off_mem);
+        c.LoadWordIdxAt(0, 0, 2);
+        c.StoreWord(0, reg_off(d.r2));
+        c.LoadWord(1, reg_off(d.r1));
+        c.Add(0, 1);
+        c.Trunc(0);
+        c.StoreWord(0, reg_off(d.r0));
+        EmitFlags(c, off_cond);
+        break;
+      case kUopStr:
+        c.LoadWord(1, reg_off(d.r1));
+        c.AddImm(1, d.imm);
+        c.Trunc(1);
+        c.LoadWord(0, reg_off(d.r0));
+        EmitStoreGuard(c, off_span, off_pc, pcs[i]);
+        c.LoadPtr(2, off_mem);
+        c.StoreWordIdxAt(0, 1, 2);
+        EmitInvalidate(c, off_dec, off_dirty, off_idle);
+        break;
+    }
+  }
+  EmitExitAt(c, off_pc, pc);  // resume interpretation at the terminator
+
+  JitBlock block = (JitBlock)(jit_buf_ + jit_used_);
+  jit_used_ = (usize)(c.p - jit_buf_);
+  for (u16 a = start; a != pc; ++a) jit_span_[a] = 1;
+  jit_starts_[jit_start_cnt_++] = start;
+  jit_blocks_[start] = block;
+  decoded_[start].uop = kUopJit;
+  // A block spans at most kJitMaxBlockLen words, so at most two pages;
+  // the entry handler checks these against page_dirty_. Length and a
+  // hash of the source words let a dirty hit vet the block in place
+  // instead of flushing the cache; see JitVetDirty. FNV-1a, not an
+  // additive sum: the hash must notice order (swapped words) and paired
+  // edits that cancel in a sum. 32 bits, split across the spare fields.
+  decoded_[start].r1 = (u16)(start >> kPageShift);
+  decoded_[start].r2 = (u16)((u16)(pc - 1) >> kPageShift);
+  decoded_[start].imm = (u16)(pc - start);
+  u32 hash = 2166136261u;
+  for (u16 a = start; a != pc; ++a) hash = (hash ^ memory_[a]) * 16777619u;
+  decoded_[start].imm2 = (u16)hash;
+  decoded_[start].r0 = (u16)(hash >> 16);
+}
+
+#endif  // LC3_JIT
+
+// Dispatch
+// --------
+//
+// Two interpreter cores share the handler bodies below:
+//
+// - The portable one is the classic while/switch loop: one indirect branch
+//   through a single jump table for every instruction, so the branch
+//   predictor sees all opcodes aliased onto one branch.
+// - With LC3_THREADED_DISPATCH (requires the GNU labels-as-values
+//   extension) each handler ends with its own `goto *dispatch[op]`, so
+//   every opcode gets its own indirect branch and trains the predictor
+//   independently.
+//
+// Both cores execute predecoded micro-ops from decoded_, not raw words;
+// kUopMiss decodes in place and retries, so a cold or invalidated entry
+// costs one extra dispatch. VM_CASE opens a handler (switch case vs.
+// label), VM_NEXT ends one (break back to the loop vs. fetch-and-jump).
+
+#if defined(LC3_THREADED_DISPATCH) && !defined(__GNUC__)
+#error "LC3_THREADED_DISPATCH requires GNU labels-as-values"
+#endif
+
+#ifdef LC3_THREADED_DISPATCH
+#define VM_CASE(uop, label) label:
+#define VM_NEXT()                                 \
+  do {                                            \
+    if (!running) goto vm_done;                   \
+    if (kSliced && slice_budget_-- <= 0) goto vm_done; \
+    if (intr_pending_.load(std::memory_order_relaxed)) ServiceInterrupt(); \
+    ++instr_count_;                               \
+    pc = reg_[kRPC]++;                            \
+    d = &decoded_[pc];                            \
+    VM_PROFILE();                                 \
+    VM_TRACE();                                   \
+    goto *dispatch[d->uop];                       \
+  } while (0)
+#else
+#define VM_CASE(uop, label) case uop:
+#define VM_NEXT() break
+#endif
+
+// Compiled away entirely in the RunLoop<false> instantiation.
+#define VM_PROFILE()                              \
+  do {                                            \
+    if (kProfile) {                               \
+      ++prof_->uop_counts[d->uop];                \
+      ++prof_->pc_hits[pc];                       \
+    }                                             \
+  } while (0)
+
+// Records the *previous* instruction once we have fetched the next one,
+// so its result register is already visible. Misses are skipped: the
+// retry dispatch sees the freshly decoded entry and records it once.
+#define VM_TRACE()                                \
+  do {                                            \
+    if (kTrace && d->uop != kUopMiss) {           \
+      if (td) ItraceAppend(tpc, memory_[tpc], td); \
+      td = d;                                     \
+      tpc = pc;                                   \
+    }                                             \
+  } while (0)
+
+#ifdef LC3_JIT
+#define VM_JIT_NOTE() JitNote(reg_[kRPC])
+#else
+#define VM_JIT_NOTE() ((void)0)
+#endif
+
+void VM::Run() {
+  g_sigint_vm = this;
+  if (prof_) {
+    g_profile_vm = this;
+    signal(SIGUSR1, HandleProfileDump);
+  }
+
+  // Initial state; a restored snapshot resumes with its saved registers.
+  if (!started_) {
+    if (!restored_) {
+      reg_[kRCond] = kFlZro;
+      reg_[kRPC] = 0x3000;
+    }
+    started_ = true;
+  }
+
+  if (itrace_buf_[0]) {
+    RunLoop<false, false, false, true>();
+  } else if (prof_) {
+    if (batch_)
+      RunLoop<true, false, true, false>();
+    else
+      RunLoop<true, false, false, false>();
+    if (profile_dump_) DumpProfile();
+  } else if (batch_) {
+    RunLoop<false, false, true, false>();
+  } else {
+    RunLoop<false, false, false, false>();
+  }
+
+  FlushOutput();  // bad-opcode exits bypass the halt trap
+  if (outq_) FinishAsyncOutput();
+  if (rec_fd_ >= 0) FinishRecord();
+  if (itrace_fd_ >= 0) FinishItrace();
+}
+
+VmRunState VM::Step(u64 max_instructions) {
+  if (halted_) return kVmDone;
+  if (!started_) {
+    if (!restored_) {
+      reg_[kRCond] = kFlZro;
+      reg_[kRPC] = 0x3000;
+    }
+    started_ = true;
+    sliced_ = true;
+  }
+
+  // slice_budget_ counts down through an i64; cap rather than wrap.
+  slice_budget_ = max_instructions > (u64)INT64_MAX ? INT64_MAX : (i64)max_instructions;
+  slice_state_ = kVmReady;
+  RunLoop<false, true, false, false>();
+  FlushOutput();  // don't sit on output across scheduling delays
+  return halted_ ? kVmDone : slice_state_;
+}
+
+template <bool kProfile, bool kSliced, bool kBatchIo, bool kTrace>
+void VM::RunLoop() {
+  bool running = true;
+  u16 pc = 0;
+  const Decoded *d = nullptr;
+  u16 tpc = 0;                   // last traced pc; dead unless kTrace
+  const Decoded *td = nullptr;
+
+#ifdef LC3_THREADED_DISPATCH
+  // Indexed by Decoded::uop; every micro-op has a label, no default needed.
+  static void *dispatch[kUopCnt] = {
+      &&uop_miss, &&uop_br,  &&uop_add_r, &&uop_add_i, &&uop_and_r,
+      &&uop_and_i, &&uop_jmp, &&uop_jsr_i, &&uop_jsr_r, &&uop_ld,
+      &&uop_ldi,  &&uop_ldr, &&uop_lea,   &&uop_not,   &&uop_st,
+      &&uop_sti,  &&uop_str, &&uop_trap,  &&uop_rti, &&uop_addi_br,
+      &&uop_neg, &&uop_ld_add, &&uop_bad,
+#ifdef LC3_JIT
+      &&uop_jit,
+#else
+      &&uop_bad,
+#endif
+  };
+  VM_NEXT();
+  {
+#else
+  while (running) {
+    if (kSliced && slice_budget_-- <= 0) break;
+    if (intr_pending_.load(std::memory_order_relaxed)) ServiceInterrupt();
+    ++instr_count_;
+    pc = reg_[kRPC]++;
+    d = &decoded_[pc];
+    VM_PROFILE();
+    VM_TRACE();
+
+    switch (d->uop) {
+#endif
+      VM_CASE(kUopMiss, uop_miss) {
+        Decode(pc);
+        reg_[kRPC] = pc;  // retry through the freshly decoded entry
+        VM_NEXT();
       }
-      case kOpTrap: {
-        switch (instr & 0xFF) {
+      VM_CASE(kUopAddR, uop_add_r) {
+        reg_[d->r0] = reg_[d->r1] + reg_[d->r2];
+        SetCc(reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopAddI, uop_add_i) {
+        reg_[d->r0] = reg_[d->r1] + d->imm;
+        SetCc(reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopAndR, uop_and_r) {
+        reg_[d->r0] = reg_[d->r1] & reg_[d->r2];
+        SetCc(reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopAndI, uop_and_i) {
+        reg_[d->r0] = reg_[d->r1] & d->imm;
+        SetCc(reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopBr, uop_br) {
+        if (CondMask() & d->r0) {
+          reg_[kRPC] += d->imm;
+          VM_JIT_NOTE();
+        }
+        VM_NEXT();
+      }
+      VM_CASE(kUopJmp, uop_jmp) /* RET */ {
+        reg_[kRPC] = reg_[d->r1];
+        VM_JIT_NOTE();
+        VM_NEXT();
+      }
+      VM_CASE(kUopJsrI, uop_jsr_i) {
+        reg_[kR7] = reg_[kRPC];
+        reg_[kRPC] += d->imm;
+        VM_JIT_NOTE();
+        VM_NEXT();
+      }
+      VM_CASE(kUopJsrR, uop_jsr_r) {
+        reg_[kR7] = reg_[kRPC];
+        reg_[kRPC] = reg_[d->r1];
+        VM_JIT_NOTE();
+        VM_NEXT();
+      }
+      VM_CASE(kUopLd, uop_ld) {
+        u16 addr = reg_[kRPC] + d->imm;
+        reg_[d->r0] = MemRead(addr);
+        SetCc(reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopLdi, uop_ldi) {
+        u16 addr = reg_[kRPC] + d->imm;
+        reg_[d->r0] = MemRead(MemRead(addr));
+        SetCc(reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopLdr, uop_ldr) {
+        u16 addr = reg_[d->r1] + d->imm;
+        reg_[d->r0] = MemRead(addr);
+        SetCc(reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopLea, uop_lea) {
+        reg_[d->r0] = reg_[kRPC] + d->imm;
+        SetCc(reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopNot, uop_not) {
+        reg_[d->r0] = ~reg_[d->r1];
+        SetCc(reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopBad, uop_bad)
+#ifndef LC3_THREADED_DISPATCH
+      default:
+#endif
+      {
+        printf("bad opcode");
+        running = false;
+        halted_ = true;
+        VM_NEXT();
+      }
+      VM_CASE(kUopSt, uop_st) {
+        u16 addr = reg_[kRPC] + d->imm;
+        MemWrite(addr, reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopSti, uop_sti) {
+        u16 addr = reg_[kRPC] + d->imm;
+        MemWrite(MemRead(addr), reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopStr, uop_str) {
+        u16 addr = reg_[d->r1] + d->imm;
+        MemWrite(addr, reg_[d->r0]);
+        VM_NEXT();
+      }
+      VM_CASE(kUopTrap, uop_trap) {
+        if (kProfile) ++prof_->trap_counts[d->imm & 0xFF];
+        switch (d->imm) {
           case kTrapGetc: {
-            reg_[kR0] = getchar();
-            UpdateFlag(kR0);
+            FlushOutput();
+            if (kSliced && !FdReadable(in_fd_, 0)) {
+              // Yield and re-execute the trap once input arrives.
+              reg_[kRPC] = pc;
+              slice_state_ = kVmWaitInput;
+              slice_budget_ = 0;
+              break;
+            }
+            if (replay_) {
+              reg_[kR0] = NextReplay().value;
+            } else {
+              reg_[kR0] = (kSliced || kBatchIo) ? ReadByteFd() : ReadKey();
+              if (rec_buf_) Record(kEvKey, reg_[kR0]);
+            }
+            SetCc(reg_[kR0]);
             break;
           }
           case kTrapOut: {
-            putc(reg_[kR0], stdout);
-            fflush(stdout);
+            PutByte(reg_[kR0]);
             break;
           }
           case kTrapPuts: {
             u16 *c = memory_ + reg_[kR0];
             while (*c) {
-              putc((char)*c, stdout);
+              PutByte((char)*c);
               ++c;
             }
-            fflush(stdout);
             break;
           }
           case kTrapIn: {
-            printf("Enter a character: ");
-            char c = getc(stdin);
-            putc(c, stdout);
-            fflush(stdout);
-            reg_[kR0] = c;
-            UpdateFlag(kR0);
+            if (kSliced && !FdReadable(in_fd_, 0)) {
+              reg_[kRPC] = pc;  // prompt once input is actually there
+              slice_state_ = kVmWaitInput;
+              slice_budget_ = 0;
+              break;
+            }
+            TrapInPrompt(kSliced || kBatchIo);
             break;
           }
           case kTrapPutsp: {
             u16 *c = memory_ + reg_[kR0];
             while (*c) {
               char c1 = *c & 0xFF;
-              putc(c1, stdout);
+              PutByte(c1);
               char c2 = *c >> 8;
-              if (c2) putc(c2, stdout);
+              if (c2) PutByte(c2);
               ++c;
             }
-            fflush(stdout);
             break;
           }
           case kTrapHalt: {
             running = false;
-            puts("halt");
-            fflush(stdout);
+            halted_ = true;
+            PutString("halt\n");
+            FlushOutput();
+            break;
+          }
+          case kTrapSnap: {
+            TrapSnap();
+            break;
+          }
+          case kTrapMul: {
+            if (!ext_traps_) break;
+            reg_[kR0] = (u16)(reg_[kR0] * reg_[kR1]);
+            SetCc(reg_[kR0]);
+            break;
+          }
+          case kTrapDiv:
+          case kTrapMod: {
+            if (!ext_traps_) break;
+            i16 a = (i16)reg_[kR0], b = (i16)reg_[kR1];
+            i16 q = b == 0 ? 0 : (d->imm == kTrapDiv ? (i16)(a / b) : (i16)(a % b));
+            reg_[kR0] = (u16)q;
+            SetCc(reg_[kR0]);
+            break;
+          }
+          case kTrapMemset: {
+            if (!ext_traps_) break;
+            u16 dst = reg_[kR0], v = reg_[kR1];
+            u32 len = ClampRange(dst, reg_[kR2]);
+            for (u32 i = 0; i < len; ++i) memory_[dst + i] = v;
+            InvalidateRange(dst, len);
+            break;
+          }
+          case kTrapMemcpy: {
+            if (!ext_traps_) break;
+            u16 dst = reg_[kR0], src = reg_[kR1];
+            u32 len = ClampRange(dst, ClampRange(src, reg_[kR2]));
+            memmove(memory_ + dst, memory_ + src, len * sizeof(u16));
+            InvalidateRange(dst, len);
             break;
           }
         }
-        break;
+        if (unbuffered_) FlushOutput();
+        VM_NEXT();
       }
-      default:
-        printf("bad opcode");
-        running = false;
-        break;
+      VM_CASE(kUopRti, uop_rti) {
+        if (in_isr_) {
+          // Inverse of the ServiceInterrupt pushes: pop PC, then the
+          // condition mask, which SetCc re-encodes as a flag-bearing value.
+          reg_[kRPC] = MemRead(reg_[kR6]++);
+          u16 psr = MemRead(reg_[kR6]++);
+          SetCc((psr & kFlNeg) ? (u16)0x8000 : (psr & kFlPos) ? (u16)1 : (u16)0);
+          in_isr_ = false;
+          // An interrupt-driven guest may never poll the keyboard or hit
+          // an input trap again, so the ISR's output has to leave now.
+          if (out_len_) FlushOutput();
+          VM_JIT_NOTE();
+        } else {
+          printf("bad opcode");  // RTI outside an ISR, as before
+          running = false;
+        }
+        VM_NEXT();
+      }
+      VM_CASE(kUopAddIBr, uop_addi_br) {
+        reg_[d->r0] = reg_[d->r1] + d->imm;
+        SetCc(reg_[d->r0]);
+        reg_[kRPC] = pc + 2;
+        if (CondMask() & d->r2) {
+          reg_[kRPC] += d->imm2;
+          VM_JIT_NOTE();
+        }
+        VM_NEXT();
+      }
+      VM_CASE(kUopNeg, uop_neg) {
+        reg_[d->r0] = ~reg_[d->r1] + 1;
+        SetCc(reg_[d->r0]);
+        reg_[kRPC] = pc + 2;
+        VM_NEXT();
+      }
+      VM_CASE(kUopLdAdd, uop_ld_add) {
+        u16 addr = reg_[kRPC] + d->imm;
+        u16 v = MemRead(addr);
+        reg_[d->r2] = v;
+        reg_[d->r0] = reg_[d->r1] + v;
+        SetCc(reg_[d->r0]);
+        reg_[kRPC] = pc + 2;
+        VM_NEXT();
+      }
+#ifdef LC3_JIT
+      VM_CASE(kUopJit, uop_jit) {
+        if (page_dirty_[d->r1] | page_dirty_[d->r2]) {
+          // A store touched a page this block covers since the last
+          // check; vet the compiled blocks against it. Only a block
+          // whose source words actually changed gets dropped.
+          JitVetDirty();
+          if (d->uop != kUopJit) {  // this block itself was modified
+            Decode(pc);
+            reg_[kRPC] = pc;  // retry through the freshly decoded entry
+            VM_NEXT();
+          }
+        }
+        jit_blocks_[pc](this);
+        // Blocks are straight-line, so the PC advance is the retire count.
+        instr_count_ += (u16)(reg_[kRPC] - pc);
+        // A guard bail at the block's FIRST instruction exits with the PC
+        // still at the block head, which would just re-enter the block.
+        // Re-decode the head (dropping the kUopJit patch) and interpret
+        // from there; a completed block always exits past its head.
+        if (reg_[kRPC] == pc) Decode(pc);
+        VM_NEXT();
+      }
+#endif
+#ifdef LC3_THREADED_DISPATCH
+  }
+vm_done:;
+#else
     }
   }
+#endif
 
-  RestoreInputBuffering();
+  // The final instruction has no successor fetch to piggyback on.
+  if (kTrace && td) ItraceAppend(tpc, memory_[tpc], td);
+
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_PROFILE
+#undef VM_TRACE
+#undef VM_JIT_NOTE
 }
 
-}  // namespace lc3
+// Benchmarking
+// ------------
+//
+// --bench N runs each embedded micro-workload below N times (plus one
+// untimed warmup) and reports min/median/stddev wall time, instructions
+// per second, and ns per instruction. A separate calibration pass first
+// runs the workload with per-uop dispatch counters and the JIT forced
+// off; the workloads are deterministic, so the exact retired-instruction
+// count from that pass prices the timed runs too. Bench I/O mode
+// discards console output and reports the keyboard as idle, so the
+// numbers measure the interpreter and not the host terminal.
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    printf("Usage: lc3 <image-file>\n");
-    return 0;
+namespace {
+
+struct BenchWorkload {
+  const char *name;
+  u16 origin;
+  const u16 *words;
+  usize len;
+};
+
+// Tight ALU loop, 200 x 30000 iterations; hits the fused negate and
+// add-branch paths.
+const u16 kBenchAlu[] = {
+    0x240A,  //        LD   R2, OUTER
+    0x220A,  // OUT:   LD   R1, INNER
+    0x5020,  //        AND  R0, R0, #0
+    0x1021,  // LOOP:  ADD  R0, R0, #1
+    0x963F,  //        NOT  R3, R0
+    0x16E1,  //        ADD  R3, R3, #1
+    0x1261,  //        ADD  R1, R1, #1
+    0x09FB,  //        BRn  LOOP
+    0x14A1,  //        ADD  R2, R2, #1
+    0x09F7,  //        BRn  OUT
+    0xF025,  //        HALT
+    0xFF38,  // OUTER: .FILL #-200
+    0x8AD0,  // INNER: .FILL #-30000
+};
+
+// STR/LDR walk over a 1024-word buffer, 500 passes; exercises MemWrite
+// and its decode-cache invalidation on every iteration.
+const u16 kBenchMemwalk[] = {
+    0x240B,  //        LD   R2, OUTER
+    0xE60C,  // OUT:   LEA  R3, BUF
+    0x220A,  //        LD   R1, INNER
+    0x70C0,  // LOOP:  STR  R0, R3, #0
+    0x60C0,  //        LDR  R0, R3, #0
+    0x1021,  //        ADD  R0, R0, #1
+    0x16E1,  //        ADD  R3, R3, #1
+    0x1261,  //        ADD  R1, R1, #1
+    0x09FA,  //        BRn  LOOP
+    0x14A1,  //        ADD  R2, R2, #1
+    0x09F6,  //        BRn  OUT
+    0xF025,  //        HALT
+    0xFE0C,  // OUTER: .FILL #-500
+    0xFC00,  // INNER: .FILL #-1024
+};           // BUF follows at x300E (zero-initialized memory)
+
+// kTrapPuts in a loop; exercises the buffered output path.
+const u16 kBenchPuts[] = {
+    0x2205,  //        LD   R1, CNT
+    0xE005,  // LOOP:  LEA  R0, STR
+    0xF022,  //        PUTS
+    0x1261,  //        ADD  R1, R1, #1
+    0x09FC,  //        BRn  LOOP
+    0xF025,  //        HALT
+    0xB1E0,  // CNT:   .FILL #-20000
+    'b', 'e', 'n', 'c', 'h', 'm', 'a', 'r', 'k', 'i', 'n', 'g', ' ',
+    't', 'h', 'e', ' ', 'o', 'u', 't', 'p', 'u', 't', ' ',
+    'p', 'a', 't', 'h', '\n', 0,  // STR: .STRINGZ
+};
+
+// LDI of the keyboard status register, 100 x 30000 polls; exercises the
+// device-page read dispatch.
+const u16 kBenchMmioPoll[] = {
+    0x2407,  //        LD   R2, OUTER
+    0x2207,  // OUT:   LD   R1, CNT
+    0xA007,  // LOOP:  LDI  R0, KBSRP
+    0x1261,  //        ADD  R1, R1, #1
+    0x09FD,  //        BRn  LOOP
+    0x14A1,  //        ADD  R2, R2, #1
+    0x09FA,  //        BRn  OUT
+    0xF025,  //        HALT
+    0xFF9C,  // OUTER: .FILL #-100
+    0x8AD0,  // CNT:   .FILL #-30000
+    0xFE00,  // KBSRP: .FILL xFE00
+};
+
+double Now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+int CmpDouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+}  // namespace
+
+void RunBench(int iters) {
+  static const BenchWorkload kWorkloads[] = {
+      {"alu", 0x3000, kBenchAlu, sizeof(kBenchAlu) / sizeof(u16)},
+      {"memwalk", 0x3000, kBenchMemwalk, sizeof(kBenchMemwalk) / sizeof(u16)},
+      {"puts", 0x3000, kBenchPuts, sizeof(kBenchPuts) / sizeof(u16)},
+      {"mmio-poll", 0x3000, kBenchMmioPoll, sizeof(kBenchMmioPoll) / sizeof(u16)},
+  };
+
+  printf("%d timed iterations per workload, 1 warmup\n", iters);
+  for (usize w = 0; w < sizeof(kWorkloads) / sizeof(kWorkloads[0]); ++w) {
+    const BenchWorkload &wl = kWorkloads[w];
+
+    // Calibration: exact dispatch and retired-instruction counts.
+    u64 counts[kUopCnt] = {};
+    {
+      VM *vm = new VM();
+      vm->SetBenchIo(true);
+      vm->EnableProfile(false);
+      vm->LoadWords(wl.origin, wl.words, wl.len);
+      vm->Run();
+      memcpy(counts, vm->GetProfile()->uop_counts, sizeof(counts));
+      delete vm;
+    }
+    u64 instrs = 0;
+    for (int u = kUopBr; u < kUopCnt; ++u) instrs += counts[u];
+    // Fused pairs retire two architectural instructions per dispatch.
+    instrs += counts[kUopAddIBr] + counts[kUopNeg] + counts[kUopLdAdd];
+
+    double *times = new double[iters];
+    for (int i = -1; i < iters; ++i) {  // iteration -1 is the warmup
+      VM *vm = new VM();
+      vm->SetBenchIo(true);
+      vm->LoadWords(wl.origin, wl.words, wl.len);
+      double t0 = Now();
+      vm->Run();
+      double t1 = Now();
+      if (i >= 0) times[i] = t1 - t0;
+      delete vm;
+    }
+    qsort(times, iters, sizeof(double), CmpDouble);
+    double min = times[0];
+    double median = times[iters / 2];
+    double mean = 0;
+    for (int i = 0; i < iters; ++i) mean += times[i];
+    mean /= iters;
+    double var = 0;
+    for (int i = 0; i < iters; ++i) var += (times[i] - mean) * (times[i] - mean);
+    double sd = sqrt(var / iters);
+
+    printf("%-9s %11llu instr  median %8.3f ms  min %8.3f  sd %6.3f  %7.1f Minstr/s  %6.2f ns/instr\n",
+           wl.name, (unsigned long long)instrs, median * 1e3, min * 1e3,
+           sd * 1e3, (double)instrs / median * 1e-6, median * 1e9 / (double)instrs);
+    printf("  dispatch:");
+    for (int u = 0; u < kUopCnt; ++u) {
+      if (counts[u]) printf(" %s=%llu", kUopNames[u], (unsigned long long)counts[u]);
+    }
+    printf("\n");
+    delete[] times;
   }
+}
 
-  FILE *file = fopen(argv[1], "rb");
-  if (!file) {
-    printf("can't open file: %s\n", argv[1]);
-    return 0;
+// Multi-VM engine
+// ---------------
+//
+// VmPool runs many guests in one process on a small worker-thread pool,
+// instead of paying full process overhead per 128 KB guest. Each guest
+// gets an instruction-budget timeslice (Step) and is fed back into a
+// shared run queue; idle workers pull the next runnable guest from it,
+// which balances load across cores the way per-worker stealing deques
+// would without needing them at this queue-op rate (one lock per ~50K
+// guest instructions). Guests that yield waiting on console input get a
+// short readability wait before requeueing so an idle fleet doesn't turn
+// the scheduler into a spin loop.
+
+constexpr u32 kPoolSliceInstrs = 50000;
+constexpr int kPoolInputWaitMs = 1;
+
+class VmPool {
+ public:
+  explicit VmPool(int threads) : threads_(threads) {
+    pthread_mutex_init(&mu_, NULL);
+    pthread_cond_init(&work_, NULL);
+  }
+
+  ~VmPool() {
+    for (int i = 0; i < cnt_; ++i) delete vms_[i];
+    free(vms_);
+    free(queue_);
+  }
+
+  // Takes ownership of a loaded, fd-routed VM.
+  void Add(VM *vm) {
+    if (cnt_ == cap_) {
+      cap_ = cap_ ? cap_ * 2 : 64;
+      vms_ = (VM **)realloc(vms_, cap_ * sizeof(VM *));
+      queue_ = (int *)realloc(queue_, cap_ * sizeof(int));
+    }
+    vms_[cnt_++] = vm;
+  }
+
+  // Runs every guest to completion.
+  void Run() {
+    if (cnt_ == 0) return;
+    live_ = cnt_;
+    qhead_ = qtail_ = 0;
+    for (int i = 0; i < cnt_; ++i) queue_[i] = i;
+    qtail_ = qlen_ = cnt_;
+
+    int n = threads_ < cnt_ ? threads_ : cnt_;
+    if (n < 1) n = 1;
+    pthread_t *workers = new pthread_t[n];
+    for (int i = 0; i < n; ++i) pthread_create(&workers[i], NULL, Worker, this);
+    for (int i = 0; i < n; ++i) pthread_join(workers[i], NULL);
+    delete[] workers;
+  }
+
+ private:
+  static void *Worker(void *arg) {
+    ((VmPool *)arg)->WorkerLoop();
+    return NULL;
+  }
+
+  void WorkerLoop() {
+    for (;;) {
+      pthread_mutex_lock(&mu_);
+      while (qlen_ == 0 && live_ > 0) pthread_cond_wait(&work_, &mu_);
+      if (qlen_ == 0) {  // nothing queued and nothing live: drained
+        pthread_mutex_unlock(&mu_);
+        return;
+      }
+      int idx = queue_[qhead_++ % cap_];
+      --qlen_;
+      pthread_mutex_unlock(&mu_);
+
+      VmRunState st = vms_[idx]->Step(kPoolSliceInstrs);
+      if (st == kVmWaitInput) vms_[idx]->WaitForInput(kPoolInputWaitMs);
+
+      pthread_mutex_lock(&mu_);
+      if (st == kVmDone) {
+        if (--live_ == 0) pthread_cond_broadcast(&work_);
+      } else {
+        queue_[qtail_++ % cap_] = idx;
+        ++qlen_;
+        pthread_cond_signal(&work_);
+      }
+      pthread_mutex_unlock(&mu_);
+    }
+  }
+
+  int threads_;
+  VM **vms_ = NULL;
+  int *queue_ = NULL;  // ring of runnable VM indices, qlen_ deep
+  int cnt_ = 0, cap_ = 0;
+  int qhead_ = 0, qtail_ = 0, qlen_ = 0, live_ = 0;
+  pthread_mutex_t mu_;
+  pthread_cond_t work_;
+};
+
+// Fleet runner
+// ------------
+//
+// --fleet <dir> runs one image over every regular file in a directory
+// (parameter sweeps): the image is loaded once and published as a CoW
+// master, and a pool of hardware-thread workers pulls inputs off a
+// shared atomic cursor. Pull scheduling gives the same tail behaviour as
+// per-worker stealing deques at this task rate -- an idle worker grabs
+// the next input the moment it finishes, so a slow straggler only ever
+// holds one core. Each input runs to completion in batch mode with the
+// file as stdin and console output in <input>.out.
+
+struct FleetCtx {
+  char **inputs;
+  int count;
+  int master_fd;
+  std::atomic<int> next{0};
+};
+
+void *FleetWorker(void *arg) {
+  FleetCtx *ctx = (FleetCtx *)arg;
+  for (;;) {
+    int i = ctx->next.fetch_add(1, std::memory_order_relaxed);
+    if (i >= ctx->count) return NULL;
+    VM *vm = new VM();
+    if (!vm->AttachMemory(ctx->master_fd)) {
+      delete vm;
+      continue;
+    }
+    vm->SetBatch();
+    char out_path[4096];
+    snprintf(out_path, sizeof(out_path), "%s.out", ctx->inputs[i]);
+    int ifd = open(ctx->inputs[i], O_RDONLY);
+    int ofd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ifd >= 0) vm->SetInputFd(ifd);
+    if (ofd >= 0) vm->SetOutputFd(ofd);
+    vm->Run();
+    if (ifd >= 0) close(ifd);
+    if (ofd >= 0) close(ofd);
+    delete vm;
+  }
+}
+
+int CmpPath(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int RunFleet(const char *dir, const char *image) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    printf("can't open fleet dir: %s\n", dir);
+    return -1;
+  }
+  int cap = 64, count = 0;
+  char **inputs = (char **)malloc(cap * sizeof(char *));
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    usize n = strlen(e->d_name);
+    if (n > 4 && strcmp(e->d_name + n - 4, ".out") == 0) continue;  // prior results
+    char *p = (char *)malloc(strlen(dir) + n + 2);
+    sprintf(p, "%s/%s", dir, e->d_name);
+    struct stat st;
+    if (stat(p, &st) != 0 || !S_ISREG(st.st_mode)) {
+      free(p);
+      continue;
+    }
+    if (count == cap) inputs = (char **)realloc(inputs, (cap *= 2) * sizeof(char *));
+    inputs[count++] = p;
   }
+  closedir(d);
+  qsort(inputs, count, sizeof(char *), CmpPath);  // deterministic numbering
 
-  fseek(file, 0, SEEK_END);
-  i64 n = ftell(file);
-  rewind(file);
+  VM *master = new VM();
+  int master_fd = -1;
+  if (!master->LoadImageMapped(image) || (master_fd = master->ShareMemory()) < 0) {
+    printf("can't load image: %s\n", image);
+    delete master;
+    return -1;
+  }
+  delete master;  // workers only need the memfd
 
-  char *image = new char[n + 1];
-  fread(image, 1, n, file);
-  fclose(file);
+  FleetCtx ctx;
+  ctx.inputs = inputs;
+  ctx.count = count;
+  ctx.master_fd = master_fd;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = ncpu > 0 ? (int)ncpu : 1;
+  if (threads > count) threads = count > 0 ? count : 1;
+  pthread_t *tids = new pthread_t[threads];
+  for (int i = 0; i < threads; ++i) pthread_create(&tids[i], NULL, FleetWorker, &ctx);
+  for (int i = 0; i < threads; ++i) pthread_join(tids[i], NULL);
+  delete[] tids;
+  close(master_fd);
+  for (int i = 0; i < count; ++i) free(inputs[i]);
+  free(inputs);
+  return 0;
+}
 
-  lc3::VM vm;
-  vm.LoadImage(image, n);
-  vm.Run();
+// Offline aggregation over an instruction trace written by --trace. The
+// file is mmap'd and scanned once; records are fixed-size, so the whole
+// thing is a flat array after the header. Reports hit counts per PC in
+// the same shape as DumpProfile's hot-pcs list, plus the last instruction
+// word seen there (self-modifying guests can retire several).
+int ReportItrace(const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || (usize)st.st_size < sizeof(ItraceHeader)) {
+    printf("can't read trace: %s\n", path);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  const u8 *base = (const u8 *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    printf("can't map trace: %s\n", path);
+    return -1;
+  }
+  const ItraceHeader *h = (const ItraceHeader *)base;
+  if (h->magic != kItraceMagic) {
+    printf("not an instruction trace: %s\n", path);
+    munmap((void *)base, st.st_size);
+    return -1;
+  }
+  const ItraceRec *recs = (const ItraceRec *)(base + sizeof(ItraceHeader));
+  u64 total = (st.st_size - sizeof(ItraceHeader)) / sizeof(ItraceRec);
 
-  delete[] image;
+  u64 *hits = (u64 *)calloc(kMaxMemory + 1, sizeof(u64));
+  u16 *words = (u16 *)calloc(kMaxMemory + 1, sizeof(u16));
+  for (u64 i = 0; i < total; ++i) {
+    ++hits[recs[i].pc];
+    words[recs[i].pc] = recs[i].instr;
+  }
+
+  printf("== lc3 trace ==\n");
+  printf("records: %llu\n", (unsigned long long)total);
+  printf("hot pcs:\n");
+  u32 picked[32];
+  int npicked = 0;
+  u64 cum = 0;
+  for (int n = 0; n < 32; ++n) {
+    u64 best = 0;
+    u32 best_pc = 0;
+    for (u32 a = 0; a <= kMaxMemory; ++a) {
+      if (hits[a] <= best) continue;
+      bool used = false;
+      for (int i = 0; i < npicked; ++i) used |= picked[i] == a;
+      if (used) continue;
+      best = hits[a];
+      best_pc = a;
+    }
+    if (best == 0) break;
+    picked[npicked++] = best_pc;
+    cum += best;
+    printf("  x%04X: instr=x%04X hits=%llu (%.1f%%, cum %.1f%%)\n", best_pc,
+           words[best_pc], (unsigned long long)best,
+           100.0 * best / total, 100.0 * cum / total);
+  }
+
+  free(hits);
+  free(words);
+  munmap((void *)base, st.st_size);
+  return 0;
+}
+
+}  // namespace lc3
+
+int main(int argc, char **argv) {
+  const char **paths = new const char *[argc];
+  int npaths = 0;
+  const char *snapshot = NULL;
+  const char *fleet_dir = NULL;
+  const char *record = NULL;
+  const char *replay = NULL;
+  const char *trace = NULL;
+  const char *trace_report = NULL;
+  const char *compile_out = NULL;
+  bool unbuffered = false;
+  bool async_out = false;
+  bool profile = false;
+  bool batch = false;
+  bool ext = false;
+  bool checked = false;
+  bool restore = false;
+  int bench = 0;
+  int pool_threads = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--unbuffered") == 0) {
+      unbuffered = true;
+    } else if (strcmp(argv[i], "--async-out") == 0) {
+      async_out = true;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = true;
+    } else if (strcmp(argv[i], "--ext") == 0) {
+      ext = true;
+    } else if (strcmp(argv[i], "--checked") == 0) {
+      checked = true;
+    } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+      bench = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+      snapshot = argv[++i];
+    } else if (strcmp(argv[i], "--restore") == 0) {
+      restore = true;
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace = argv[++i];
+    } else if (strcmp(argv[i], "--trace-report") == 0 && i + 1 < argc) {
+      trace_report = argv[++i];
+    } else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+      compile_out = argv[++i];
+    } else if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc) {
+      pool_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--fleet") == 0 && i + 1 < argc) {
+      fleet_dir = argv[++i];
+    } else {
+      paths[npaths++] = argv[i];
+    }
+  }
+  if (trace_report) {
+    lc3::ReportItrace(trace_report);
+    return 0;
+  }
+  if (bench > 0) {
+    lc3::RunBench(bench);
+    return 0;
+  }
+  if (pool_threads > 0) {
+    // Fleet mode: every image becomes a pooled guest with its console
+    // routed to <image>.out and input from /dev/null. The first guest of
+    // each distinct image publishes its memory as a CoW master and the
+    // rest attach to it, so duplicates share everything but dirty pages.
+    lc3::VmPool pool(pool_threads);
+    const char **master_paths = new const char *[npaths];
+    int *master_fds = new int[npaths];
+    int nmasters = 0;
+    for (int i = 0; i < npaths; ++i) {
+      lc3::VM *vm = new lc3::VM();
+      int master = -1;
+      for (int j = 0; j < nmasters; ++j) {
+        if (strcmp(master_paths[j], paths[i]) == 0) master = master_fds[j];
+      }
+      if (master >= 0 && vm->AttachMemory(master)) {
+        // shared; nothing to load
+      } else if (vm->LoadImageMapped(paths[i])) {
+        int fd = vm->ShareMemory();
+        if (fd >= 0) {
+          master_paths[nmasters] = paths[i];
+          master_fds[nmasters++] = fd;
+        }
+      } else {
+        printf("can't load image: %s\n", paths[i]);
+        delete vm;
+        continue;
+      }
+      char out_path[4096];
+      snprintf(out_path, sizeof(out_path), "%s.out", paths[i]);
+      int ofd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (ofd >= 0) vm->SetOutputFd(ofd);
+      int ifd = open("/dev/null", O_RDONLY);
+      if (ifd >= 0) vm->SetInputFd(ifd);
+      pool.Add(vm);
+    }
+    pool.Run();
+    return 0;
+  }
+  const char *path = npaths > 0 ? paths[0] : NULL;
+  if (compile_out) {
+    if (!path) {
+      printf("Usage: lc3 --compile <out.lc3x> <image-file>\n");
+      return 0;
+    }
+    lc3::VM *vm = new lc3::VM();
+    if (!vm->CompileLc3x(path, compile_out)) printf("can't compile: %s\n", path);
+    delete vm;
+    return 0;
+  }
+  if (fleet_dir && path) {
+    lc3::RunFleet(fleet_dir, path);
+    return 0;
+  }
+  if (!path) {
+    printf("Usage: lc3 [--unbuffered] [--async-out] [--batch] [--ext] [--checked] [--profile] [--snapshot <file>] <image-file>\n");
+    printf("       lc3 [--record <trace>|--replay <trace>] <image-file>\n");
+    printf("       lc3 --trace <file> <image-file>   (then: lc3 --trace-report <file>)\n");
+    printf("       lc3 --compile <out.lc3x> <image-file>   (then: lc3 <out.lc3x>)\n");
+    printf("       lc3 [--snapshot <file>] --restore <snapshot-file>\n");
+    printf("       lc3 --pool <threads> <image-file>...\n");
+    printf("       lc3 --fleet <input-dir> <image-file>\n");
+    printf("       lc3 --bench <iterations>\n");
+    return 0;
+  }
+
+  // The decode and code caches make VM too big for the stack.
+  lc3::VM *vm = new lc3::VM();
+  vm->SetUnbuffered(unbuffered);
+  if (batch) vm->SetBatch();
+  if (ext) vm->EnableExtTraps();
+  if (checked) vm->SetChecked();
+  if (async_out) vm->EnableAsyncOutput();
+  if (profile) vm->EnableProfile(true);
+  if (snapshot) vm->SetSnapshotPath(snapshot);
+  if (record && !vm->StartRecord(record)) {
+    printf("can't record to: %s\n", record);
+    delete vm;
+    return 0;
+  }
+  if (replay && !vm->LoadReplay(replay)) {
+    printf("can't load trace: %s\n", replay);
+    delete vm;
+    return 0;
+  }
+  if (trace && !vm->StartItrace(trace)) {
+    printf("can't trace to: %s\n", trace);
+    delete vm;
+    return 0;
+  }
+  if (restore) {
+    int fd = open(path, O_RDONLY);
+    bool ok = fd >= 0 && vm->RestoreSnapshot(fd);
+    if (fd >= 0) close(fd);
+    if (!ok) {
+      printf("can't restore snapshot: %s\n", path);
+      delete vm;
+      return 0;
+    }
+  } else if (!vm->LoadImageMapped(path)) {
+    printf("can't load image: %s\n", path);
+    delete vm;
+    return 0;
+  }
+  if (batch) {
+    vm->Run();  // batch guests never own the terminal
+  } else {
+    lc3::TerminalGuard term;
+    vm->Run();
+  }
+  delete vm;
 
   return 0;
 }